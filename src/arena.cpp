@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <allegro5/allegro.h>
+#include <string>
+#include <vector>
+
+#include "arena.h"
+
+using std::vector;
+using std::string;
+
+// #define debug(...) printf(__VA_ARGS__)
+#define debug(...)
+
+/* Fits about 200 RGBA thumbnails */
+static const size_t SLAB_SIZE = 4 * 1024 * 1024;
+
+/* Everything handed out is aligned to this */
+static const size_t ALIGN = 8;
+
+ThumbnailArena::ThumbnailArena():
+slabUsed(SLAB_SIZE),
+totalUsed(0),
+totalReserved(0),
+totalResident(0),
+compact(false),
+spill(nullptr),
+spillSize(0){
+    mutex = al_create_mutex();
+}
+
+ThumbnailArena::~ThumbnailArena(){
+    for (unsigned char * slab: slabs){
+        free(slab);
+    }
+    if (spill != nullptr){
+        fclose(spill);
+    }
+    al_destroy_mutex(mutex);
+}
+
+static size_t thumbnailBytes(int width, int height, int depth){
+    return sizeof(Thumbnail) + width * height * depth;
+}
+
+void ThumbnailArena::setCompact(bool compact){
+    this->compact = compact;
+}
+
+unsigned char * ThumbnailArena::allocate(size_t bytes, bool thumbnail){
+    bytes = (bytes + ALIGN - 1) / ALIGN * ALIGN;
+
+    unsigned char * out = nullptr;
+    al_lock_mutex(mutex);
+    if (thumbnail){
+        totalResident += bytes;
+        std::map<size_t, vector<unsigned char*> >::iterator found = unused.find(bytes);
+        if (found != unused.end() && found->second.size() > 0){
+            out = found->second.back();
+            found->second.pop_back();
+            al_unlock_mutex(mutex);
+            return out;
+        }
+    }
+
+    if (bytes > SLAB_SIZE){
+        /* Doesn't happen with thumbnails but give it its own slab, the current
+         * slab keeps filling up.
+         */
+        out = (unsigned char *) malloc(bytes);
+        if (out != nullptr){
+            slabs.insert(slabs.begin(), out);
+            totalReserved += bytes;
+            totalUsed += bytes;
+        }
+    } else {
+        if (slabUsed + bytes > SLAB_SIZE){
+            unsigned char * slab = (unsigned char *) malloc(SLAB_SIZE);
+            if (slab != nullptr){
+                slabs.push_back(slab);
+                slabUsed = 0;
+                totalReserved += SLAB_SIZE;
+            }
+        }
+        if (slabUsed + bytes <= SLAB_SIZE){
+            out = slabs.back() + slabUsed;
+            slabUsed += bytes;
+            totalUsed += bytes;
+        }
+    }
+    if (out == nullptr && thumbnail){
+        totalResident -= bytes;
+    }
+    al_unlock_mutex(mutex);
+
+    return out;
+}
+
+const Thumbnail * ThumbnailArena::add(ALLEGRO_BITMAP * bitmap){
+    int width = al_get_bitmap_width(bitmap);
+    int height = al_get_bitmap_height(bitmap);
+    if (width > 0xffff || height > 0xffff){
+        return nullptr;
+    }
+
+    ALLEGRO_LOCKED_REGION * region = al_lock_bitmap(bitmap, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+    if (region == nullptr){
+        return nullptr;
+    }
+
+    /* The space is reserved under the lock but copying the pixels in doesn't
+     * need it, nothing else will touch this part of the slab.
+     */
+    int depth = compact ? 2 : 4;
+    unsigned char * memory = allocate(thumbnailBytes(width, height, depth), true);
+    if (memory == nullptr){
+        al_unlock_bitmap(bitmap);
+        return nullptr;
+    }
+
+    Thumbnail * thumbnail = (Thumbnail *) memory;
+    thumbnail->width = width;
+    thumbnail->height = height;
+    thumbnail->depth = depth;
+    thumbnail->unused = 0;
+
+    unsigned char * pixels = memory + sizeof(Thumbnail);
+    for (int y = 0; y < height; y++){
+        const unsigned char * line = (const unsigned char *) region->data + y * region->pitch;
+        if (depth == 4){
+            memcpy(pixels + y * width * 4, line, width * 4);
+        } else {
+            uint16_t * out = (uint16_t *)(pixels + y * width * 2);
+            for (int x = 0; x < width; x++){
+                const unsigned char * pixel = line + x * 4;
+                out[x] = ((pixel[0] >> 3) << 11) | ((pixel[1] >> 2) << 5) | (pixel[2] >> 3);
+            }
+        }
+    }
+
+    al_unlock_bitmap(bitmap);
+    return thumbnail;
+}
+
+const char * ThumbnailArena::addName(const string & name){
+    char * out = (char *) allocate(name.size() + 1, false);
+    if (out == nullptr){
+        return "";
+    }
+    memcpy(out, name.c_str(), name.size() + 1);
+    return out;
+}
+
+void ThumbnailArena::read(const Thumbnail * thumbnail, unsigned char * out, int pitch){
+    int width = thumbnail->width;
+    const unsigned char * pixels = thumbnail->pixels();
+    for (int y = 0; y < thumbnail->height; y++){
+        unsigned char * line = out + y * pitch;
+        if (thumbnail->depth == 4){
+            memcpy(line, pixels + y * width * 4, width * 4);
+        } else {
+            const uint16_t * in = (const uint16_t *)(pixels + y * width * 2);
+            for (int x = 0; x < width; x++){
+                uint16_t pixel = in[x];
+                int red = (pixel >> 11) & 31;
+                int green = (pixel >> 5) & 63;
+                int blue = pixel & 31;
+                line[x * 4 + 0] = (red << 3) | (red >> 2);
+                line[x * 4 + 1] = (green << 2) | (green >> 4);
+                line[x * 4 + 2] = (blue << 3) | (blue >> 2);
+                line[x * 4 + 3] = 255;
+            }
+        }
+    }
+}
+
+ALLEGRO_BITMAP * ThumbnailArena::bitmap(const Thumbnail * thumbnail){
+    int oldFlags = al_get_new_bitmap_flags();
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    ALLEGRO_BITMAP * out = al_create_bitmap(thumbnail->width, thumbnail->height);
+    al_set_new_bitmap_flags(oldFlags);
+    if (out == nullptr){
+        return nullptr;
+    }
+
+    ALLEGRO_LOCKED_REGION * region = al_lock_bitmap(out, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+    if (region == nullptr){
+        al_destroy_bitmap(out);
+        return nullptr;
+    }
+    read(thumbnail, (unsigned char *) region->data, region->pitch);
+    al_unlock_bitmap(out);
+    return out;
+}
+
+int64_t ThumbnailArena::evict(const Thumbnail * thumbnail, int64_t spill){
+    size_t bytes = thumbnailBytes(thumbnail->width, thumbnail->height, thumbnail->depth);
+
+    /* The pixels never change so once a thumbnail is in the spill file it
+     * never has to be written again.
+     */
+    if (spill < 0){
+        if (this->spill == nullptr){
+            this->spill = tmpfile();
+            if (this->spill == nullptr){
+                return -1;
+            }
+        }
+
+        if (pwrite(fileno(this->spill), thumbnail, bytes, spillSize) != (ssize_t) bytes){
+            return -1;
+        }
+        spill = spillSize;
+        spillSize += bytes;
+    }
+
+    bytes = (bytes + ALIGN - 1) / ALIGN * ALIGN;
+    al_lock_mutex(mutex);
+    unused[bytes].push_back((unsigned char *) thumbnail);
+    totalResident -= bytes;
+    al_unlock_mutex(mutex);
+
+    return spill;
+}
+
+const Thumbnail * ThumbnailArena::restore(int64_t spill){
+    if (this->spill == nullptr || spill < 0){
+        return nullptr;
+    }
+
+    Thumbnail header;
+    if (pread(fileno(this->spill), &header, sizeof(header), spill) != sizeof(header)){
+        return nullptr;
+    }
+
+    size_t bytes = thumbnailBytes(header.width, header.height, header.depth);
+    unsigned char * memory = allocate(bytes, true);
+    if (memory == nullptr){
+        return nullptr;
+    }
+
+    if (pread(fileno(this->spill), memory, bytes, spill) != (ssize_t) bytes){
+        /* Give the memory back */
+        bytes = (bytes + ALIGN - 1) / ALIGN * ALIGN;
+        al_lock_mutex(mutex);
+        unused[bytes].push_back(memory);
+        totalResident -= bytes;
+        al_unlock_mutex(mutex);
+        return nullptr;
+    }
+
+    return (const Thumbnail *) memory;
+}
+
+size_t ThumbnailArena::resident() const {
+    size_t out = 0;
+    al_lock_mutex(mutex);
+    out = totalResident;
+    al_unlock_mutex(mutex);
+    return out;
+}
+
+size_t ThumbnailArena::used() const {
+    size_t out = 0;
+    al_lock_mutex(mutex);
+    out = totalUsed;
+    al_unlock_mutex(mutex);
+    return out;
+}
+
+size_t ThumbnailArena::reserved() const {
+    size_t out = 0;
+    al_lock_mutex(mutex);
+    out = totalReserved;
+    al_unlock_mutex(mutex);
+    return out;
+}
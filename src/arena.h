@@ -0,0 +1,106 @@
+#ifndef _viewer_arena_h
+#define _viewer_arena_h
+
+#include <allegro5/allegro.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+
+/* A thumbnail stored in a ThumbnailArena, the pixels follow right after it */
+struct Thumbnail{
+    uint16_t width;
+    uint16_t height;
+    /* Bytes per pixel, 4 for RGBA or 2 for RGB565 */
+    uint16_t depth;
+    uint16_t unused;
+
+    const unsigned char * pixels() const {
+        return (const unsigned char *)(this + 1);
+    }
+};
+
+/* Holds the pixels of every thumbnail and the names of their files.
+ *
+ * With a few hundred thousand pictures a separate memory bitmap and string per
+ * picture adds up to gigabytes, mostly allocator overhead and fragmentation.
+ * Instead everything is packed one after the other into big slabs that are only
+ * freed when the arena goes away. Bitmaps are only made from the pixels when a
+ * thumbnail is on screen.
+ *
+ * To stay inside a memory budget thumbnails can be evicted to a spill file and
+ * restored later. The memory of an evicted thumbnail is reused by the next
+ * thumbnail of exactly the same size, which is most of them since photos
+ * usually share a few aspect ratios.
+ *
+ * What one picture costs with the normal 80x60 thumbnail:
+ *   RGBA:    8 byte header + 19200 bytes of pixels
+ *   RGB565:  8 byte header +  9600 bytes of pixels (no alpha)
+ * plus the file name and its terminator, rounded up to 8 bytes. Outside of the
+ * arena there is the Image itself (56 bytes) and a pointer to it in the View.
+ * The bench program prints the measured numbers.
+ *
+ * add and addName can be called from any number of threads, evict and restore
+ * only from one.
+ */
+class ThumbnailArena{
+public:
+    ThumbnailArena();
+    ~ThumbnailArena();
+
+    /* Store pixels as RGB565 from now on, halving the memory but losing alpha.
+     * Should be called before anything is added.
+     */
+    void setCompact(bool compact);
+
+    /* Copies the bitmap in. Returns nullptr if the bitmap couldn't be locked. */
+    const Thumbnail * add(ALLEGRO_BITMAP * bitmap);
+
+    /* Copies the string in */
+    const char * addName(const std::string & name);
+
+    /* Writes the pixels as RGBA bytes (ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE) */
+    static void read(const Thumbnail * thumbnail, unsigned char * out, int pitch);
+
+    /* Makes a new memory bitmap out of the thumbnail */
+    static ALLEGRO_BITMAP * bitmap(const Thumbnail * thumbnail);
+
+    /* Gives the memory of the thumbnail back so it can't be used anymore. The
+     * thumbnail is written to the spill file first unless spill already says
+     * where it is. Returns where it is in the spill file, or -1 if it couldn't
+     * be written in which case nothing happened.
+     */
+    int64_t evict(const Thumbnail * thumbnail, int64_t spill);
+
+    /* Reads an evicted thumbnail back, nullptr if that fails */
+    const Thumbnail * restore(int64_t spill);
+
+    /* Bytes of thumbnails that are in memory */
+    size_t resident() const;
+
+    /* Bytes handed out so far, and bytes in slabs (what the arena really costs) */
+    size_t used() const;
+    size_t reserved() const;
+
+protected:
+    /* Thumbnails can reuse the memory of evicted ones, names never go away */
+    unsigned char * allocate(size_t bytes, bool thumbnail);
+
+    ALLEGRO_MUTEX * mutex;
+    std::vector<unsigned char*> slabs;
+    /* Memory of evicted thumbnails by size */
+    std::map<size_t, std::vector<unsigned char*> > unused;
+    /* Bytes used in the last slab */
+    size_t slabUsed;
+    size_t totalUsed;
+    size_t totalReserved;
+    size_t totalResident;
+    bool compact;
+
+    /* Evicted thumbnails, created when the first one is evicted */
+    FILE * spill;
+    int64_t spillSize;
+};
+
+#endif
@@ -0,0 +1,526 @@
+/* Measures the loading pipeline without opening a window.
+ *
+ * A synthetic corpus of images in different sizes and formats is generated (the
+ * same one every time for a given seed) and then every stage of the viewer is run
+ * over it: the directory scan, decoding and thumbnailing a file, the whole
+ * thumbnail pipeline with a cold and a warm thumbnail cache and loading full
+ * images through the ImageManager. It also measures how much memory a thumbnail
+ * costs in the arena. The results are written as JSON.
+ *
+ *   $ bench [--corpus directory] [--count files] [--seed number] [--output file]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_image.h>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+
+#include "events.h"
+#include "load.h"
+#include "cache.h"
+#include "scan.h"
+#include "image-manager.h"
+#include "arena.h"
+
+using std::vector;
+using std::string;
+
+// #define debug(...) printf(__VA_ARGS__)
+#define debug(...)
+
+/* Small deterministic random number generator so the corpus is reproducible */
+class Random{
+public:
+    Random(uint32_t seed):
+    state(seed * 2654435761u + 1){
+    }
+
+    uint32_t next(){
+        state = state * 1664525u + 1013904223u;
+        return state >> 8;
+    }
+
+    int range(int low, int high){
+        return low + next() % (high - low + 1);
+    }
+
+    uint32_t state;
+};
+
+struct Size{
+    int width;
+    int height;
+};
+
+static const Size sizes[] = {
+    {64, 64},
+    {320, 240},
+    {640, 480},
+    {1024, 768},
+    {1920, 1080},
+    {3000, 2000},
+    {2000, 3000},
+    {4000, 3000},
+};
+
+static const char * formats[] = {".jpg", ".png", ".bmp", ".tga", ".pcx", ".webp"};
+
+static bool makeDirectory(const string & path){
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+static int64_t fileSize(const string & path){
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0){
+        return 0;
+    }
+    return info.st_size;
+}
+
+/* A gradient with some noise on top so the encoders have something to work with */
+static ALLEGRO_BITMAP * makePicture(Random & random, int width, int height){
+    ALLEGRO_BITMAP * bitmap = al_create_bitmap(width, height);
+    ALLEGRO_LOCKED_REGION * region = al_lock_bitmap(bitmap, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+    int red = random.range(0, 255);
+    int green = random.range(0, 255);
+    for (int y = 0; y < height; y++){
+        unsigned char * line = (unsigned char *) region->data + y * region->pitch;
+        for (int x = 0; x < width; x++){
+            int noise = random.next() & 31;
+            line[x * 4 + 0] = (red + x * 255 / width + noise) & 255;
+            line[x * 4 + 1] = (green + y * 255 / height + noise) & 255;
+            line[x * 4 + 2] = ((x / 16 + y / 16) & 1) * 128 + noise;
+            line[x * 4 + 3] = 255;
+        }
+    }
+    al_unlock_bitmap(bitmap);
+    return bitmap;
+}
+
+/* Writes count images into nested directories below the corpus directory. Every
+ * tenth file is a text file that the scan should skip. Does nothing if the corpus
+ * was already generated with the same count and seed.
+ */
+static void generateCorpus(const string & directory, int count, uint32_t seed){
+    std::ostringstream marker;
+    marker << directory << "/.corpus-" << count << "-" << seed;
+    if (fileSize(marker.str()) > 0){
+        return;
+    }
+
+    std::cerr << "Generating " << count << " files in " << directory << std::endl;
+    makeDirectory(directory);
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+
+    Random random(seed);
+    for (int i = 0; i < count; i++){
+        std::ostringstream path;
+        path << directory << "/set" << (i % 4);
+        makeDirectory(path.str());
+        if (i % 3 != 0){
+            path << "/part" << (i % 3);
+            makeDirectory(path.str());
+        }
+        if (i % 5 == 0){
+            path << "/deep";
+            makeDirectory(path.str());
+        }
+
+        path << "/image" << i;
+
+        if (i % 10 == 9){
+            std::ofstream text((path.str() + ".txt").c_str());
+            text << "not an image " << i << std::endl;
+            continue;
+        }
+
+        const Size & size = sizes[random.next() % (sizeof(sizes) / sizeof(Size))];
+        ALLEGRO_BITMAP * picture = makePicture(random, size.width, size.height);
+        /* Not every build of allegro can write every format */
+        for (unsigned int attempt = 0; attempt < sizeof(formats) / sizeof(char*); attempt++){
+            const char * format = formats[(i + attempt) % (sizeof(formats) / sizeof(char*))];
+            if (al_save_bitmap((path.str() + format).c_str(), picture)){
+                break;
+            }
+        }
+        al_destroy_bitmap(picture);
+    }
+
+    std::ofstream done(marker.str().c_str());
+    done << "done" << std::endl;
+}
+
+static double percentile(vector<double> values, double percent){
+    if (values.size() == 0){
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    int index = (int)(percent / 100.0 * values.size() + 0.5) - 1;
+    if (index < 0){
+        index = 0;
+    }
+    if (index >= (int) values.size()){
+        index = values.size() - 1;
+    }
+    return values[index];
+}
+
+static string latency(const vector<double> & values){
+    std::ostringstream out;
+    out << "{\"count\": " << values.size()
+        << ", \"p50\": " << percentile(values, 50)
+        << ", \"p95\": " << percentile(values, 95)
+        << ", \"p99\": " << percentile(values, 99) << "}";
+    return out.str();
+}
+
+struct PipelineResult{
+    PipelineResult():
+    seconds(0),
+    firstThumbnail(0),
+    lastPage(0),
+    thumbnails(0),
+    events(0){
+    }
+
+    double seconds;
+    double firstThumbnail;
+    /* Until the prioritized files at the end were all done */
+    double lastPage;
+    int thumbnails;
+    /* VIEW_TYPE events the thumbnails came in */
+    int events;
+};
+
+/* How many files at the end of the list are prioritized in the pipeline, as
+ * if the user jumped to the last page of the grid right away.
+ */
+static const int LAST_PAGE = 20;
+
+struct PipelineStuff{
+    vector<string> * files;
+    vector<int> * priority;
+    ThumbnailCache * cache;
+    ThumbnailArena * arena;
+    ThumbnailResults * results;
+    ALLEGRO_EVENT_SOURCE * events;
+};
+
+static void * runPipeline(ALLEGRO_THREAD * self, void * data){
+    PipelineStuff * stuff = (PipelineStuff*) data;
+    FileQueue queue;
+    queue.add(*stuff->files);
+    queue.prioritize(*stuff->priority);
+    queue.finish();
+    loadFiles(queue, *stuff->cache, *stuff->arena, *stuff->results, stuff->events);
+    return nullptr;
+}
+
+/* Runs loadFiles over the files and collects the thumbnails as they come out.
+ * The last page of files is prioritized like the view would.
+ */
+static PipelineResult pipeline(const string & corpus, vector<string> & files){
+    ALLEGRO_EVENT_SOURCE events;
+    al_init_user_event_source(&events);
+    ALLEGRO_EVENT_QUEUE * queue = al_create_event_queue();
+    al_register_event_source(queue, &events);
+
+    ThumbnailCache cache(corpus);
+    ThumbnailArena arena;
+    ThumbnailResults results(&events);
+    vector<int> priority;
+    for (int i = std::max(0, (int) files.size() - LAST_PAGE); i < (int) files.size(); i++){
+        priority.push_back(i);
+    }
+    int waiting = priority.size();
+
+    PipelineStuff stuff;
+    stuff.files = &files;
+    stuff.priority = &priority;
+    stuff.cache = &cache;
+    stuff.arena = &arena;
+    stuff.results = &results;
+    stuff.events = &events;
+
+    PipelineResult result;
+    double start = al_get_time();
+    ALLEGRO_THREAD * thread = al_create_thread(runPipeline, &stuff);
+    al_start_thread(thread);
+
+    bool done = false;
+    while (!done){
+        ALLEGRO_EVENT event;
+        al_wait_for_event(queue, &event);
+        if (event.type == VIEW_TYPE){
+            result.events += 1;
+            for (const ThumbnailResult & taken: results.take()){
+                /* The thumbnails stay in the arena */
+                if (taken.thumbnail != nullptr){
+                    if (result.thumbnails == 0){
+                        result.firstThumbnail = (al_get_time() - start) * 1000;
+                    }
+                    result.thumbnails += 1;
+                }
+                if (taken.index >= (int) files.size() - LAST_PAGE){
+                    waiting -= 1;
+                    if (waiting == 0){
+                        result.lastPage = (al_get_time() - start) * 1000;
+                    }
+                }
+            }
+        } else if (event.type == PERCENT_TYPE && event.user.data1 == 100){
+            /* loadFiles sends 100 last */
+            done = true;
+        }
+    }
+    result.seconds = al_get_time() - start;
+
+    al_join_thread(thread, nullptr);
+    al_destroy_thread(thread);
+    al_destroy_event_queue(queue);
+    al_destroy_user_event_source(&events);
+    return result;
+}
+
+static string pipelineJson(const PipelineResult & result, int64_t bytes){
+    std::ostringstream out;
+    out << "{\"seconds\": " << result.seconds
+        << ", \"thumbnails\": " << result.thumbnails
+        << ", \"files_per_second\": " << (result.seconds > 0 ? result.thumbnails / result.seconds : 0)
+        << ", \"mb_per_second\": " << (result.seconds > 0 ? bytes / 1048576.0 / result.seconds : 0)
+        << ", \"view_events\": " << result.events
+        << ", \"first_thumbnail_ms\": " << result.firstThumbnail
+        << ", \"last_page_ms\": " << result.lastPage << "}";
+    return out.str();
+}
+
+/* Time from asking the image manager for a file until its loaded, and until
+ * its preview was there for the files that get one.
+ */
+static vector<double> managerLatency(const vector<string> & files, int count, vector<double> & previews){
+    ALLEGRO_EVENT_SOURCE events;
+    al_init_user_event_source(&events);
+    ALLEGRO_EVENT_QUEUE * queue = al_create_event_queue();
+    al_register_event_source(queue, &events);
+
+    vector<double> out;
+    {
+        ImageManager manager(&events);
+        /* Only the current image is kept so every get is a real load */
+        manager.setCacheBudget(0);
+        for (int i = 0; i < count && i < (int) files.size(); i++){
+            double start = al_get_time();
+            ALLEGRO_BITMAP * bitmap = manager.get(files[i]);
+            bool previewed = false;
+            while (bitmap == nullptr){
+                ALLEGRO_EVENT event;
+                al_wait_for_event(queue, &event);
+                if (event.type == LOAD_TYPE){
+                    manager.upload();
+                    bitmap = manager.get(files[i]);
+                    /* A file that couldn't be loaded is cached as nullptr */
+                    if (bitmap != nullptr || manager.findCached(files[i]) != manager.cache.end()){
+                        break;
+                    }
+                    if (!previewed && manager.getPreview(files[i]) != nullptr){
+                        previewed = true;
+                        previews.push_back((al_get_time() - start) * 1000);
+                    }
+                }
+            }
+            out.push_back((al_get_time() - start) * 1000);
+        }
+    }
+
+    al_destroy_event_queue(queue);
+    al_destroy_user_event_source(&events);
+    return out;
+}
+
+static bool sameBitmaps(ALLEGRO_BITMAP * a, ALLEGRO_BITMAP * b){
+    int width = al_get_bitmap_width(a);
+    int height = al_get_bitmap_height(a);
+    if (width != al_get_bitmap_width(b) || height != al_get_bitmap_height(b)){
+        return false;
+    }
+
+    ALLEGRO_LOCKED_REGION * first = al_lock_bitmap(a, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+    ALLEGRO_LOCKED_REGION * second = al_lock_bitmap(b, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+    bool same = first != nullptr && second != nullptr;
+    for (int y = 0; same && y < height; y++){
+        same = memcmp((const unsigned char *) first->data + y * first->pitch,
+                      (const unsigned char *) second->data + y * second->pitch,
+                      width * 4) == 0;
+    }
+    if (first != nullptr){
+        al_unlock_bitmap(a);
+    }
+    if (second != nullptr){
+        al_unlock_bitmap(b);
+    }
+    return same;
+}
+
+/* Arena bytes per thumbnail, including the file name */
+static double arenaCost(const ThumbnailArena & arena, int count){
+    if (count == 0){
+        return 0;
+    }
+    return (double) arena.used() / count;
+}
+
+static bool alwaysContinue(){
+    return false;
+}
+
+int main(int argc, char ** argv){
+    string corpus = "bench-corpus";
+    string output;
+    int count = 200;
+    uint32_t seed = 1;
+    for (int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if (arg == "--corpus" && i + 1 < argc){
+            corpus = argv[++i];
+        } else if (arg == "--count" && i + 1 < argc){
+            count = atoi(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc){
+            seed = atoi(argv[++i]);
+        } else if (arg == "--output" && i + 1 < argc){
+            output = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--corpus directory] [--count files] [--seed number] [--output file]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (!al_init() || !al_init_image_addon()){
+        std::cerr << "Could not initialize allegro" << std::endl;
+        return 1;
+    }
+
+    globalQuit = al_create_mutex();
+
+    generateCorpus(corpus, count, seed);
+
+    /* Keep the thumbnail cache next to the corpus and start it out empty */
+    string cacheHome = corpus + "-cache";
+    makeDirectory(cacheHome);
+    setenv("XDG_CACHE_HOME", cacheHome.c_str(), 1);
+    {
+        ThumbnailCache empty(corpus);
+        /* Saving a complete cache that was never used removes every entry */
+        empty.save(true);
+    }
+
+    /* Scan */
+    FileQueue found;
+    double scanStart = al_get_time();
+    scanImages(corpus, true, found, alwaysContinue);
+    double scanSeconds = al_get_time() - scanStart;
+
+    vector<string> files;
+    string file;
+    int index = 0;
+    while (found.next(file, index)){
+        files.push_back(file);
+    }
+    std::sort(files.begin(), files.end());
+
+    int64_t bytes = 0;
+    for (const string & file: files){
+        bytes += fileSize(file);
+    }
+
+    /* Decode and thumbnail one file at a time. The thumbnails are kept in an
+     * arena of each format to measure what a picture really costs.
+     */
+    vector<double> decode;
+    vector<double> thumbnail;
+    ThumbnailArena full;
+    ThumbnailArena compact;
+    compact.setCompact(true);
+    int stored = 0;
+    bool roundTrip = true;
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    for (const string & file: files){
+        double start = al_get_time();
+        ALLEGRO_BITMAP * image = load_thumbnail_source(file);
+        double decoded = al_get_time();
+        decode.push_back((decoded - start) * 1000);
+        if (image != nullptr){
+            ALLEGRO_BITMAP * small = create_thumbnail(image);
+            thumbnail.push_back((al_get_time() - decoded) * 1000);
+
+            const Thumbnail * packed = full.add(small);
+            compact.add(small);
+            full.addName(file);
+            compact.addName(file);
+            stored += 1;
+
+            /* The RGBA copy has to come back exactly the same */
+            ALLEGRO_BITMAP * back = packed != nullptr ? ThumbnailArena::bitmap(packed) : nullptr;
+            if (back == nullptr || !sameBitmaps(small, back)){
+                roundTrip = false;
+            }
+            if (back != nullptr){
+                al_destroy_bitmap(back);
+            }
+
+            al_destroy_bitmap(small);
+            al_destroy_bitmap(image);
+        }
+    }
+
+    PipelineResult cold = pipeline(corpus, files);
+    PipelineResult warm = pipeline(corpus, files);
+
+    vector<double> previews;
+    vector<double> manager = managerLatency(files, 50, previews);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    std::ostringstream json;
+    json << "{\n"
+         << "  \"corpus\": {\"directory\": \"" << corpus << "\", \"files\": " << files.size() << ", \"bytes\": " << bytes << ", \"seed\": " << seed << "},\n"
+         << "  \"scan\": {\"seconds\": " << scanSeconds << ", \"files_per_second\": " << (scanSeconds > 0 ? files.size() / scanSeconds : 0) << "},\n"
+         << "  \"decode_ms\": " << latency(decode) << ",\n"
+         << "  \"thumbnail_ms\": " << latency(thumbnail) << ",\n"
+         << "  \"pipeline_cold\": " << pipelineJson(cold, bytes) << ",\n"
+         << "  \"pipeline_warm\": " << pipelineJson(warm, bytes) << ",\n"
+         << "  \"image_manager_ms\": " << latency(manager) << ",\n"
+         << "  \"image_manager_preview_ms\": " << latency(previews) << ",\n"
+         << "  \"memory_per_image\": {\"rgba_bytes\": " << arenaCost(full, stored)
+         << ", \"rgb565_bytes\": " << arenaCost(compact, stored)
+         << ", \"image_bytes\": " << sizeof(Image) + sizeof(Image*)
+         << ", \"rgba_reserved\": " << full.reserved()
+         << ", \"rgb565_reserved\": " << compact.reserved()
+         << ", \"round_trip\": " << (roundTrip ? "true" : "false") << "},\n"
+         /* ru_maxrss is in kilobytes on linux */
+         << "  \"peak_rss_kb\": " << usage.ru_maxrss << "\n"
+         << "}\n";
+
+    if (output != ""){
+        std::ofstream out(output.c_str());
+        out << json.str();
+    } else {
+        std::cout << json.str();
+    }
+
+    al_destroy_mutex(globalQuit);
+    return 0;
+}
@@ -0,0 +1,433 @@
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+using std::string;
+using std::vector;
+
+// #define debug(...) printf(__VA_ARGS__)
+#define debug(...)
+
+/* Pack file layout, all numbers in host byte order:
+ *
+ *   header:  8 byte magic, uint32 entry count, uint32 unused
+ *   entries: uint32 path length, uint32 width, uint32 height, uint32 unused,
+ *            int64 size, int64 mtime,
+ *            path bytes padded to a multiple of 8,
+ *            width * height * 4 bytes of ABGR_8888_LE pixels padded to a multiple of 8
+ *
+ * The journal is the same except the count in its header is unused, entries are
+ * read until the end of the file and later ones replace earlier ones.
+ */
+static const char PACK_MAGIC[8] = {'V', 'T', 'H', 'U', 'M', 'B', '0', '1'};
+
+struct PackHeader{
+    char magic[8];
+    uint32_t count;
+    uint32_t unused;
+};
+
+struct PackEntry{
+    uint32_t pathLength;
+    uint32_t width;
+    uint32_t height;
+    uint32_t unused;
+    int64_t size;
+    int64_t mtime;
+};
+
+static size_t pad8(size_t size){
+    return (size + 7) & ~(size_t) 7;
+}
+
+uint64_t hashString(const string & what){
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c: what){
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+string cacheDirectory(){
+    const char * xdg = getenv("XDG_CACHE_HOME");
+    if (xdg != nullptr && xdg[0] != '\0'){
+        return string(xdg) + "/viewer";
+    }
+    const char * home = getenv("HOME");
+    if (home != nullptr && home[0] != '\0'){
+        return string(home) + "/.cache/viewer";
+    }
+    return "";
+}
+
+bool makeDirectories(const string & path){
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)){
+        string part = path.substr(0, slash);
+        if (mkdir(part.c_str(), 0755) != 0 && errno != EEXIST){
+            return false;
+        }
+        if (slash == string::npos){
+            return true;
+        }
+    }
+}
+
+ThumbnailCache::ThumbnailCache(const string & directory):
+directory(directory),
+map(nullptr),
+mapSize(0),
+journalMap(nullptr),
+journalMapSize(0),
+journal(-1),
+dirty(false){
+    mutex = al_create_mutex();
+
+    if (this->directory.size() > 0 && this->directory[this->directory.size() - 1] != '/'){
+        this->directory += "/";
+    }
+
+    char * real = realpath(directory.c_str(), nullptr);
+    string where = cacheDirectory();
+    if (real != nullptr && where != ""){
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.pack", (unsigned long long) hashString(real));
+        packPath = where + "/" + name;
+        journalPath = packPath + ".journal";
+        load();
+    }
+    free(real);
+}
+
+ThumbnailCache::~ThumbnailCache(){
+    if (journal != -1){
+        close(journal);
+    }
+    if (journalMap != nullptr){
+        munmap(journalMap, journalMapSize);
+    }
+    if (map != nullptr){
+        munmap(map, mapSize);
+    }
+    al_destroy_mutex(mutex);
+}
+
+/* Maps a whole file read only, nullptr if it isn't there or is too short to
+ * have a header
+ */
+static void * mapFile(const string & path, size_t & size){
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1){
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(PackHeader)){
+        close(fd);
+        return nullptr;
+    }
+
+    void * data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    /* The mapping stays valid after the descriptor is closed */
+    close(fd);
+    if (data == MAP_FAILED){
+        return nullptr;
+    }
+
+    size = info.st_size;
+    return data;
+}
+
+static bool hasMagic(const void * data){
+    return memcmp(((const PackHeader *) data)->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) == 0;
+}
+
+void ThumbnailCache::load(){
+    map = mapFile(packPath, mapSize);
+    if (map != nullptr){
+        if (hasMagic(map)){
+            const unsigned char * start = (const unsigned char *) map;
+            readEntries(start + sizeof(PackHeader), start + mapSize, ((const PackHeader *) map)->count, entries);
+        } else {
+            debug("Ignoring pack file %s with the wrong magic\n", packPath.c_str());
+        }
+    }
+
+    journalMap = mapFile(journalPath, journalMapSize);
+    if (journalMap != nullptr && hasMagic(journalMap)){
+        const unsigned char * start = (const unsigned char *) journalMap;
+        readEntries(start + sizeof(PackHeader), start + journalMapSize, UINT32_MAX, entries);
+        /* Fold it into the pack on save even if nothing new is put */
+        dirty = true;
+    }
+
+    debug("Loaded %d cached thumbnails from %s\n", (int) entries.size(), packPath.c_str());
+}
+
+void ThumbnailCache::readEntries(const unsigned char * position, const unsigned char * end, uint32_t count, std::map<string, Entry> & out){
+    for (uint32_t i = 0; i < count; i++){
+        if ((size_t) (end - position) < sizeof(PackEntry)){
+            break;
+        }
+        const PackEntry * pack = (const PackEntry *) position;
+        size_t pathSize = pad8(pack->pathLength);
+        size_t pixelSize = pad8((size_t) pack->width * pack->height * 4);
+        if (pack->width == 0 || pack->height == 0 ||
+            (size_t) (end - position) < sizeof(PackEntry) + pathSize + pixelSize){
+            /* Truncated, keep whatever came before */
+            break;
+        }
+
+        string path((const char *) position + sizeof(PackEntry), pack->pathLength);
+
+        Entry entry;
+        entry.size = pack->size;
+        entry.mtime = pack->mtime;
+        entry.width = pack->width;
+        entry.height = pack->height;
+        entry.pixels = position + sizeof(PackEntry) + pathSize;
+        entry.used = false;
+        out[path] = entry;
+
+        position += sizeof(PackEntry) + pathSize + pixelSize;
+    }
+}
+
+bool ThumbnailCache::makeKey(const string & file, Key & key) const {
+    struct stat info;
+    if (stat(file.c_str(), &info) != 0){
+        return false;
+    }
+
+    if (file.compare(0, directory.size(), directory) == 0){
+        key.path = file.substr(directory.size());
+    } else {
+        key.path = file;
+    }
+    key.size = info.st_size;
+    key.mtime = (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    return true;
+}
+
+ALLEGRO_BITMAP * ThumbnailCache::get(const Key & key){
+    Entry entry;
+    al_lock_mutex(mutex);
+    std::map<string, Entry>::iterator found = entries.find(key.path);
+    bool hit = found != entries.end() &&
+               found->second.pixels != nullptr &&
+               found->second.size == key.size &&
+               found->second.mtime == key.mtime;
+    if (hit){
+        found->second.used = true;
+        entry = found->second;
+    }
+    al_unlock_mutex(mutex);
+
+    if (!hit){
+        return nullptr;
+    }
+
+    ALLEGRO_BITMAP * out = al_create_bitmap(entry.width, entry.height);
+    if (out == nullptr){
+        return nullptr;
+    }
+
+    ALLEGRO_LOCKED_REGION * region = al_lock_bitmap(out, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+    if (region == nullptr){
+        al_destroy_bitmap(out);
+        return nullptr;
+    }
+    for (int y = 0; y < entry.height; y++){
+        memcpy((unsigned char *) region->data + y * region->pitch,
+               entry.pixels + y * entry.width * 4,
+               entry.width * 4);
+    }
+    al_unlock_bitmap(out);
+
+    return out;
+}
+
+void ThumbnailCache::put(const Key & key, ALLEGRO_BITMAP * thumbnail){
+    if (packPath == ""){
+        return;
+    }
+
+    int width = al_get_bitmap_width(thumbnail);
+    int height = al_get_bitmap_height(thumbnail);
+    ALLEGRO_LOCKED_REGION * region = al_lock_bitmap(thumbnail, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+    if (region == nullptr){
+        return;
+    }
+
+    /* The whole entry is built first so it goes out in one write */
+    size_t pathSize = pad8(key.path.size());
+    size_t pixelSize = (size_t) width * height * 4;
+    vector<unsigned char> record(sizeof(PackEntry) + pathSize + pad8(pixelSize), 0);
+    PackEntry * pack = (PackEntry *) &record[0];
+    pack->pathLength = key.path.size();
+    pack->width = width;
+    pack->height = height;
+    pack->unused = 0;
+    pack->size = key.size;
+    pack->mtime = key.mtime;
+    memcpy(&record[sizeof(PackEntry)], key.path.data(), key.path.size());
+    unsigned char * pixels = &record[sizeof(PackEntry) + pathSize];
+    for (int y = 0; y < height; y++){
+        memcpy(pixels + y * width * 4,
+               (const unsigned char *) region->data + y * region->pitch,
+               width * 4);
+    }
+    al_unlock_bitmap(thumbnail);
+
+    al_lock_mutex(mutex);
+    if (journal == -1 && makeDirectories(packPath.substr(0, packPath.rfind('/')))){
+        journal = open(journalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (journal != -1 && lseek(journal, 0, SEEK_END) == 0){
+            PackHeader header;
+            memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+            header.count = 0;
+            header.unused = 0;
+            if (write(journal, &header, sizeof(header)) != (ssize_t) sizeof(header)){
+                close(journal);
+                journal = -1;
+                unlink(journalPath.c_str());
+            }
+        }
+    }
+
+    if (journal != -1){
+        off_t before = lseek(journal, 0, SEEK_END);
+        if (write(journal, &record[0], record.size()) == (ssize_t) record.size()){
+            Entry entry;
+            entry.size = key.size;
+            entry.mtime = key.mtime;
+            entry.width = width;
+            entry.height = height;
+            /* Read back from the journal by save */
+            entry.pixels = nullptr;
+            entry.used = true;
+            entries[key.path] = entry;
+            dirty = true;
+        } else if (before != -1){
+            /* Don't leave half an entry for the next one to be appended to */
+            if (ftruncate(journal, before) != 0){
+                close(journal);
+                journal = -1;
+            }
+        }
+    }
+    al_unlock_mutex(mutex);
+}
+
+static bool writeEntry(FILE * out, const string & path, int64_t size, int64_t mtime, int width, int height, const unsigned char * pixels){
+    static const unsigned char zeros[8] = {0};
+
+    PackEntry pack;
+    pack.pathLength = path.size();
+    pack.width = width;
+    pack.height = height;
+    pack.unused = 0;
+    pack.size = size;
+    pack.mtime = mtime;
+
+    size_t pixelSize = (size_t) width * height * 4;
+    return fwrite(&pack, sizeof(pack), 1, out) == 1 &&
+           fwrite(path.data(), 1, path.size(), out) == path.size() &&
+           fwrite(zeros, 1, pad8(path.size()) - path.size(), out) == pad8(path.size()) - path.size() &&
+           fwrite(pixels, 1, pixelSize, out) == pixelSize &&
+           fwrite(zeros, 1, pad8(pixelSize) - pixelSize, out) == pad8(pixelSize) - pixelSize;
+}
+
+void ThumbnailCache::save(bool complete){
+    if (packPath == ""){
+        return;
+    }
+
+    if (complete){
+        for (const std::pair<const string, Entry> & entry: entries){
+            if (!entry.second.used){
+                dirty = true;
+                break;
+            }
+        }
+    }
+
+    if (!dirty){
+        return;
+    }
+
+    /* Map the journal again to get at the thumbnails put since it was opened */
+    if (journal != -1){
+        close(journal);
+        journal = -1;
+    }
+    size_t journaledSize = 0;
+    void * journaledMap = mapFile(journalPath, journaledSize);
+    std::map<string, Entry> journaled;
+    if (journaledMap != nullptr && hasMagic(journaledMap)){
+        const unsigned char * start = (const unsigned char *) journaledMap;
+        readEntries(start + sizeof(PackHeader), start + journaledSize, UINT32_MAX, journaled);
+    }
+
+    vector<std::pair<string, Entry> > keep;
+    for (const std::pair<const string, Entry> & entry: entries){
+        if (!entry.second.used && complete){
+            continue;
+        }
+        Entry out = entry.second;
+        if (out.pixels == nullptr){
+            std::map<string, Entry>::iterator found = journaled.find(entry.first);
+            if (found == journaled.end() || found->second.size != out.size || found->second.mtime != out.mtime){
+                continue;
+            }
+            out.pixels = found->second.pixels;
+        }
+        keep.push_back(std::make_pair(entry.first, out));
+    }
+
+    bool ok = makeDirectories(packPath.substr(0, packPath.rfind('/')));
+
+    /* Write to a temporary file and rename it so a crash never leaves a half
+     * written pack behind.
+     */
+    string temporary = packPath + ".tmp";
+    FILE * out = ok ? fopen(temporary.c_str(), "wb") : nullptr;
+    if (out != nullptr){
+        PackHeader header;
+        memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+        header.count = keep.size();
+        header.unused = 0;
+        ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+        for (const std::pair<string, Entry> & entry: keep){
+            if (!ok){
+                break;
+            }
+            ok = writeEntry(out, entry.first, entry.second.size, entry.second.mtime,
+                            entry.second.width, entry.second.height, entry.second.pixels);
+        }
+
+        if (fclose(out) != 0){
+            ok = false;
+        }
+
+        if (ok && rename(temporary.c_str(), packPath.c_str()) == 0){
+            /* Everything in the journal is in the pack now */
+            unlink(journalPath.c_str());
+            dirty = false;
+        } else {
+            unlink(temporary.c_str());
+        }
+    }
+
+    if (journaledMap != nullptr){
+        munmap(journaledMap, journaledSize);
+    }
+}
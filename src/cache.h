@@ -0,0 +1,109 @@
+#ifndef _viewer_cache_h
+#define _viewer_cache_h
+
+#include <allegro5/allegro.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+/* ~/.cache/viewer, or $XDG_CACHE_HOME/viewer. Empty if there is no home. */
+std::string cacheDirectory();
+
+/* mkdir -p */
+bool makeDirectories(const std::string & path);
+
+/* FNV-1a, gives each cached thing its own file name */
+uint64_t hashString(const std::string & what);
+
+/* Stores thumbnails on disk so a directory only has to be decoded once.
+ *
+ * All the thumbnails for one starting directory live in a single pack file under
+ * ~/.cache/viewer (or $XDG_CACHE_HOME/viewer). The pack is memory mapped when the
+ * cache is created and a hit is just a copy out of the mapping. Entries are keyed
+ * by the filename plus the size and modification time of the file so a changed
+ * file is thumbnailed again.
+ *
+ * New thumbnails are appended to a journal next to the pack as they are made and
+ * not kept in memory. save folds the journal into the pack. If the program dies
+ * before that the journal is read back by the next run, so the work isn't lost.
+ *
+ * get and put can be called from any number of threads at once. save should only
+ * be called once all the threads are done with the cache.
+ */
+class ThumbnailCache{
+public:
+    /* Identifies one version of a file */
+    struct Key{
+        Key():
+        size(0),
+        mtime(0){
+        }
+
+        std::string path;
+        int64_t size;
+        /* Nanoseconds */
+        int64_t mtime;
+    };
+
+    ThumbnailCache(const std::string & directory);
+    ~ThumbnailCache();
+
+    /* Fills in the key for a file, returns false if the file can't be stat'ed */
+    bool makeKey(const std::string & file, Key & key) const;
+
+    /* Returns a new memory bitmap with the stored thumbnail or nullptr if
+     * there isn't one for this version of the file.
+     */
+    ALLEGRO_BITMAP * get(const Key & key);
+
+    /* Appends a thumbnail to the journal */
+    void put(const Key & key, ALLEGRO_BITMAP * thumbnail);
+
+    /* Writes the pack file back out, with the journal folded in, if anything
+     * changed. If complete is true every file in the directory was looked up,
+     * so entries that were never used belong to files that are gone and are
+     * dropped.
+     */
+    void save(bool complete);
+
+protected:
+    struct Entry{
+        int64_t size;
+        int64_t mtime;
+        int width;
+        int height;
+        /* Offset of the pixels in a mapping, nullptr for thumbnails put since
+         * the journal was mapped
+         */
+        const unsigned char * pixels;
+        bool used;
+    };
+
+    void load();
+    /* Reads up to count entries from a mapped pack or journal */
+    void readEntries(const unsigned char * position, const unsigned char * end, uint32_t count, std::map<std::string, Entry> & out);
+
+    /* The starting directory, stripped off the front of filenames */
+    std::string directory;
+    /* Where the pack file lives, empty if there is nowhere to put it */
+    std::string packPath;
+    /* packPath + ".journal" */
+    std::string journalPath;
+
+    void * map;
+    size_t mapSize;
+    /* The journal left by a run that didn't get to save */
+    void * journalMap;
+    size_t journalMapSize;
+    /* Open for appending once the first thumbnail is put, -1 before */
+    int journal;
+
+    std::map<std::string, Entry> entries;
+    bool dirty;
+
+    /* Protects entries, journal and dirty */
+    ALLEGRO_MUTEX * mutex;
+};
+
+#endif
@@ -0,0 +1,173 @@
+#include "cancel.h"
+#include "jpeg.h"
+#include "identify.h"
+#include <stdio.h>
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_image.h>
+#include <algorithm>
+#include <string>
+
+using std::string;
+
+// #define debug(...) printf(__VA_ARGS__)
+#define debug(...)
+
+/* Big reads are split up so cancelling doesn't wait for all of them */
+static const size_t READ_CHUNK = 64 * 1024;
+
+/* The user data of a cancellable file, it reads from a normal file */
+struct CancelFile{
+    ALLEGRO_FILE * file;
+    const Cancel * cancel;
+    bool cancelled;
+};
+
+static CancelFile * getData(ALLEGRO_FILE * handle){
+    return (CancelFile*) al_get_file_userdata(handle);
+}
+
+/* Once cancelled the file stays that way */
+static bool isCancelled(CancelFile * data){
+    if (!data->cancelled && data->cancel->isCancelled()){
+        debug("Load cancelled at %d\n", (int) al_ftell(data->file));
+        data->cancelled = true;
+    }
+    return data->cancelled;
+}
+
+static bool cancelClose(ALLEGRO_FILE * handle){
+    CancelFile * data = getData(handle);
+    bool out = al_fclose(data->file);
+    delete data;
+    return out;
+}
+
+static size_t cancelRead(ALLEGRO_FILE * handle, void * ptr, size_t size){
+    CancelFile * data = getData(handle);
+    size_t total = 0;
+    while (total < size && !isCancelled(data)){
+        size_t chunk = std::min(size - total, READ_CHUNK);
+        size_t got = al_fread(data->file, (char*) ptr + total, chunk);
+        total += got;
+        if (got < chunk){
+            break;
+        }
+    }
+    return total;
+}
+
+static size_t cancelWrite(ALLEGRO_FILE * handle, const void * ptr, size_t size){
+    /* Only ever opened for reading */
+    return 0;
+}
+
+static bool cancelFlush(ALLEGRO_FILE * handle){
+    return true;
+}
+
+static int64_t cancelTell(ALLEGRO_FILE * handle){
+    return al_ftell(getData(handle)->file);
+}
+
+static bool cancelSeek(ALLEGRO_FILE * handle, int64_t offset, int whence){
+    CancelFile * data = getData(handle);
+    if (isCancelled(data)){
+        return false;
+    }
+    return al_fseek(data->file, offset, whence);
+}
+
+static bool cancelEof(ALLEGRO_FILE * handle){
+    CancelFile * data = getData(handle);
+    return data->cancelled || al_feof(data->file);
+}
+
+static int cancelError(ALLEGRO_FILE * handle){
+    CancelFile * data = getData(handle);
+    if (data->cancelled){
+        return 1;
+    }
+    return al_ferror(data->file);
+}
+
+static const char * cancelErrorMessage(ALLEGRO_FILE * handle){
+    CancelFile * data = getData(handle);
+    if (data->cancelled){
+        return "cancelled";
+    }
+    return al_ferrmsg(data->file);
+}
+
+static void cancelClearError(ALLEGRO_FILE * handle){
+    /* A cancelled load can't be picked up again */
+    al_fclearerr(getData(handle)->file);
+}
+
+static int cancelUngetc(ALLEGRO_FILE * handle, int c){
+    return al_fungetc(getData(handle)->file, c);
+}
+
+static off_t cancelSize(ALLEGRO_FILE * handle){
+    return al_fsize(getData(handle)->file);
+}
+
+static const ALLEGRO_FILE_INTERFACE cancelInterface = {
+    nullptr,
+    cancelClose,
+    cancelRead,
+    cancelWrite,
+    cancelFlush,
+    cancelTell,
+    cancelSeek,
+    cancelEof,
+    cancelError,
+    cancelErrorMessage,
+    cancelClearError,
+    cancelUngetc,
+    cancelSize
+};
+
+/* What al_load_bitmap would use to pick a loader */
+static string loaderFor(const string & file){
+    string extension = identifyImage(file);
+    if (extension == ""){
+        size_t dot = file.rfind('.');
+        if (dot != string::npos){
+            extension = file.substr(dot);
+        }
+    }
+    return extension;
+}
+
+ALLEGRO_BITMAP * loadCancellable(const string & file, const Cancel & cancel){
+    ALLEGRO_BITMAP * jpeg = loadJpeg(file, &cancel);
+    if (jpeg != nullptr || cancel.isCancelled()){
+        return jpeg;
+    }
+
+    string extension = loaderFor(file);
+    if (extension == ""){
+        return nullptr;
+    }
+
+    ALLEGRO_FILE * in = al_fopen(file.c_str(), "rb");
+    if (in == nullptr){
+        return nullptr;
+    }
+
+    CancelFile * data = new CancelFile();
+    data->file = in;
+    data->cancel = &cancel;
+    data->cancelled = false;
+    ALLEGRO_FILE * handle = al_create_file_handle(&cancelInterface, data);
+    if (handle == nullptr){
+        delete data;
+        al_fclose(in);
+        return nullptr;
+    }
+
+    ALLEGRO_BITMAP * out = al_load_bitmap_f(handle, extension.c_str());
+    /* Closes the real file and deletes data */
+    al_fclose(handle);
+    return out;
+}
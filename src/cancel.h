@@ -0,0 +1,29 @@
+#ifndef _viewer_cancel_h
+#define _viewer_cancel_h
+
+#include <allegro5/allegro.h>
+#include <string>
+
+/* Polled by a long running load to find out if it should give up. Has to be
+ * safe to call from the loading thread while another thread cancels.
+ */
+class Cancel{
+public:
+    virtual ~Cancel(){
+    }
+
+    virtual bool isCancelled() const = 0;
+};
+
+/* Loads a picture at full size like al_load_bitmap, but stops and returns nullptr
+ * soon after cancel says so instead of finishing a decode nobody wants anymore.
+ *
+ * Jpegs are decoded by libjpeg which checks every few rows. Everything else goes
+ * through the image addon with a file that starts failing its reads once the load
+ * is cancelled, so the decoder bails out the next time it needs more data. The
+ * decoders read in small chunks so that happens at least every few hundred
+ * kilobytes of the file.
+ */
+ALLEGRO_BITMAP * loadCancellable(const std::string & file, const Cancel & cancel);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _viewer_events_h
+#define _viewer_events_h
+
+#include <allegro5/allegro.h>
+
+/* Event for when new thumbnails are loaded, data1 is the ThumbnailResults to
+ * take them from
+ */
+const unsigned int VIEW_TYPE = ALLEGRO_GET_EVENT_TYPE('V', 'I', 'E', 'W');
+
+/* Event for when a percent of the files searched is incremented by at least 1 */
+const unsigned int PERCENT_TYPE = ALLEGRO_GET_EVENT_TYPE('P', 'R', 'C', 'T');
+
+/* Event for when an image request is done loading */
+const unsigned int LOAD_TYPE = ALLEGRO_GET_EVENT_TYPE('L', 'O', 'A', 'D');
+
+/* Event for when the scan found files, data1 is a FoundFiles */
+const unsigned int FOUND_TYPE = ALLEGRO_GET_EVENT_TYPE('F', 'O', 'U', 'N');
+
+/* Event for when a larger thumbnail level is built, data1 is a LevelResult */
+const unsigned int LEVEL_TYPE = ALLEGRO_GET_EVENT_TYPE('L', 'E', 'V', 'L');
+
+/* Event from a TiledImage, data2 is its id. data1 is a TileResult when a tile
+ * was read or nullptr when more tiles were built.
+ */
+const unsigned int TILE_TYPE = ALLEGRO_GET_EVENT_TYPE('T', 'I', 'L', 'E');
+
+#endif
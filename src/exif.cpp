@@ -0,0 +1,353 @@
+#include "exif.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+using std::string;
+using std::vector;
+
+// #define debug(...) printf(__VA_ARGS__)
+#define debug(...)
+
+/* Size of a jpeg or the main image in a webp, 0 if unknown */
+struct Dimensions{
+    Dimensions():
+    width(0),
+    height(0){
+    }
+
+    int width;
+    int height;
+};
+
+static bool isStartOfFrame(int marker){
+    /* SOF0 - SOF15 except DHT (C4), JPG (C8) and DAC (CC) */
+    return marker >= 0xc0 && marker <= 0xcf &&
+           marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+}
+
+/* Reads the image size out of the SOF segment of a jpeg in memory */
+static Dimensions jpegDimensions(const unsigned char * data, size_t size){
+    Dimensions out;
+    if (size < 4 || data[0] != 0xff || data[1] != 0xd8){
+        return out;
+    }
+
+    size_t position = 2;
+    while (position + 4 <= size){
+        if (data[position] != 0xff){
+            return out;
+        }
+        int marker = data[position + 1];
+        if (marker == 0xff){
+            /* Fill byte */
+            position += 1;
+            continue;
+        }
+        size_t length = (data[position + 2] << 8) | data[position + 3];
+        if (isStartOfFrame(marker)){
+            if (position + 9 <= size){
+                out.height = (data[position + 5] << 8) | data[position + 6];
+                out.width = (data[position + 7] << 8) | data[position + 8];
+            }
+            return out;
+        }
+        if (marker == 0xda){
+            /* Start of scan, no frame header */
+            return out;
+        }
+        position += 2 + length;
+    }
+
+    return out;
+}
+
+/* Reads values out of a TIFF structure in either byte order */
+class Tiff{
+public:
+    Tiff(const unsigned char * data, size_t size):
+    data(data),
+    size(size),
+    little(true){
+    }
+
+    bool valid(){
+        if (size < 8){
+            return false;
+        }
+        if (data[0] == 'I' && data[1] == 'I'){
+            little = true;
+        } else if (data[0] == 'M' && data[1] == 'M'){
+            little = false;
+        } else {
+            return false;
+        }
+        return read16(2) == 42;
+    }
+
+    uint32_t read16(size_t offset) const {
+        if (offset + 2 > size){
+            return 0;
+        }
+        if (little){
+            return data[offset] | (data[offset + 1] << 8);
+        }
+        return (data[offset] << 8) | data[offset + 1];
+    }
+
+    uint32_t read32(size_t offset) const {
+        if (offset + 4 > size){
+            return 0;
+        }
+        if (little){
+            return read16(offset) | (read16(offset + 2) << 16);
+        }
+        return (read16(offset) << 16) | read16(offset + 2);
+    }
+
+    /* Offset of the IFD after the one at the given offset */
+    uint32_t nextIfd(uint32_t ifd) const {
+        uint32_t entries = read16(ifd);
+        return read32(ifd + 2 + entries * 12);
+    }
+
+    /* Value of a SHORT or LONG tag in an IFD */
+    bool tag(uint32_t ifd, uint32_t tag, uint32_t & value) const {
+        uint32_t entries = read16(ifd);
+        for (uint32_t i = 0; i < entries; i++){
+            size_t entry = ifd + 2 + i * 12;
+            if (entry + 12 > size){
+                return false;
+            }
+            if (read16(entry) == tag){
+                uint32_t type = read16(entry + 2);
+                if (type == 3){
+                    value = read16(entry + 8);
+                } else {
+                    value = read32(entry + 8);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const unsigned char * data;
+    size_t size;
+    bool little;
+};
+
+/* Pulls the IFD1 jpeg out of a TIFF structure */
+static bool exifPreview(const unsigned char * data, size_t size, vector<unsigned char> & preview){
+    Tiff tiff(data, size);
+    if (!tiff.valid()){
+        return false;
+    }
+
+    uint32_t ifd0 = tiff.read32(4);
+    if (ifd0 == 0 || ifd0 >= size){
+        return false;
+    }
+
+    uint32_t ifd1 = tiff.nextIfd(ifd0);
+    if (ifd1 == 0 || ifd1 >= size){
+        return false;
+    }
+
+    uint32_t compression = 6;
+    tiff.tag(ifd1, 0x103, compression);
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    /* Compression 6 is old style jpeg, which is what everyone uses for the thumbnail */
+    if (compression != 6 ||
+        !tiff.tag(ifd1, 0x201, offset) ||
+        !tiff.tag(ifd1, 0x202, length) ||
+        length == 0 || offset > size || length > size - offset){
+        return false;
+    }
+
+    preview.assign(data + offset, data + offset + length);
+    return true;
+}
+
+static bool usable(const vector<unsigned char> & preview, const Dimensions & main, int minimumSize){
+    Dimensions dimensions = jpegDimensions(&preview[0], preview.size());
+    if (dimensions.width == 0 || dimensions.height == 0){
+        return false;
+    }
+
+    if (dimensions.width < minimumSize && dimensions.height < minimumSize){
+        debug("Preview is only %dx%d\n", dimensions.width, dimensions.height);
+        return false;
+    }
+
+    if (main.width > 0 && main.height > 0){
+        double mainAspect = (double) main.width / main.height;
+        double previewAspect = (double) dimensions.width / dimensions.height;
+        if (fabs(mainAspect - previewAspect) > mainAspect * 0.03){
+            debug("Preview is %dx%d but the image is %dx%d\n", dimensions.width, dimensions.height, main.width, main.height);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Walks the markers of a jpeg up to the first scan looking for the EXIF segment
+ * and the size of the main image.
+ */
+static bool jpegPreview(FILE * file, int minimumSize, vector<unsigned char> & preview){
+    Dimensions main;
+    bool found = false;
+
+    while (true){
+        int fill = fgetc(file);
+        if (fill != 0xff){
+            break;
+        }
+        int marker = fgetc(file);
+        while (marker == 0xff){
+            marker = fgetc(file);
+        }
+        if (marker == EOF || marker == 0xda || marker == 0xd9){
+            break;
+        }
+        /* Markers without a length */
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)){
+            continue;
+        }
+
+        unsigned char size[2];
+        if (fread(size, 1, 2, file) != 2){
+            break;
+        }
+        long length = ((size[0] << 8) | size[1]) - 2;
+        if (length < 0){
+            break;
+        }
+
+        if (isStartOfFrame(marker)){
+            unsigned char frame[5];
+            if (length < 5 || fread(frame, 1, 5, file) != 5){
+                break;
+            }
+            main.height = (frame[1] << 8) | frame[2];
+            main.width = (frame[3] << 8) | frame[4];
+            /* Nothing after the frame header matters */
+            break;
+        } else if (marker == 0xe1 && !found && length >= 6){
+            /* Shorter segments can't hold the EXIF header, they are skipped like any other */
+            vector<unsigned char> segment(length);
+            if (fread(&segment[0], 1, length, file) != (size_t) length){
+                break;
+            }
+            static const unsigned char exifHeader[6] = {'E', 'x', 'i', 'f', 0, 0};
+            if (length > 6 && memcmp(&segment[0], exifHeader, 6) == 0){
+                found = exifPreview(&segment[6], length - 6, preview);
+            }
+        } else if (fseek(file, length, SEEK_CUR) != 0){
+            break;
+        }
+    }
+
+    return found && usable(preview, main, minimumSize);
+}
+
+/* EXIF has to fit in one jpeg segment, webp doesn't have that limit but a
+ * bigger chunk is not a camera's and isn't worth reading
+ */
+static const uint32_t MAX_EXIF = 65536;
+
+/* Bytes between the current position and the end of the file */
+static long remaining(FILE * file){
+    long here = ftell(file);
+    if (here < 0 || fseek(file, 0, SEEK_END) != 0){
+        return 0;
+    }
+    long end = ftell(file);
+    if (fseek(file, here, SEEK_SET) != 0 || end < here){
+        return 0;
+    }
+    return end - here;
+}
+
+static uint32_t little32(const unsigned char * data){
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+static uint32_t little24(const unsigned char * data){
+    return data[0] | (data[1] << 8) | (data[2] << 16);
+}
+
+/* Walks the chunks of a webp, the canvas size comes from VP8X which is also
+ * the only kind of webp that can have an EXIF chunk.
+ */
+static bool webpPreview(FILE * file, int minimumSize, vector<unsigned char> & preview){
+    Dimensions main;
+    bool found = false;
+
+    unsigned char header[8];
+    while (fread(header, 1, 8, file) == 8){
+        uint32_t length = little32(header + 4);
+        /* Chunks are padded to an even size */
+        long skip = length + (length & 1);
+
+        if (memcmp(header, "VP8X", 4) == 0 && length >= 10){
+            unsigned char extended[10];
+            if (fread(extended, 1, 10, file) != 10){
+                break;
+            }
+            /* Flags bit 3 says there is an EXIF chunk */
+            if ((extended[0] & 0x08) == 0){
+                return false;
+            }
+            main.width = little24(extended + 4) + 1;
+            main.height = little24(extended + 7) + 1;
+            skip -= 10;
+        } else if (memcmp(header, "EXIF", 4) == 0 && length > 0){
+            /* The length comes from the file, don't trust it with an allocation */
+            if (length > MAX_EXIF || (long) length > remaining(file)){
+                return false;
+            }
+            vector<unsigned char> chunk(length);
+            if (fread(&chunk[0], 1, length, file) != length){
+                break;
+            }
+            /* Some writers keep the jpeg style prefix */
+            size_t start = 0;
+            static const unsigned char exifHeader[6] = {'E', 'x', 'i', 'f', 0, 0};
+            if (length > 6 && memcmp(&chunk[0], exifHeader, 6) == 0){
+                start = 6;
+            }
+            found = exifPreview(&chunk[start], length - start, preview);
+            break;
+        }
+
+        if (fseek(file, skip, SEEK_CUR) != 0){
+            break;
+        }
+    }
+
+    return found && usable(preview, main, minimumSize);
+}
+
+bool findEmbeddedPreview(const string & filename, int minimumSize, vector<unsigned char> & preview){
+    FILE * file = fopen(filename.c_str(), "rb");
+    if (file == nullptr){
+        return false;
+    }
+
+    bool out = false;
+    unsigned char magic[12];
+    size_t got = fread(magic, 1, sizeof(magic), file);
+    if (got >= 2 && magic[0] == 0xff && magic[1] == 0xd8){
+        fseek(file, 2, SEEK_SET);
+        out = jpegPreview(file, minimumSize, preview);
+    } else if (got == 12 && memcmp(magic, "RIFF", 4) == 0 && memcmp(magic + 8, "WEBP", 4) == 0){
+        out = webpPreview(file, minimumSize, preview);
+    }
+
+    fclose(file);
+    return out;
+}
@@ -0,0 +1,20 @@
+#ifndef _viewer_exif_h
+#define _viewer_exif_h
+
+#include <string>
+#include <vector>
+
+/* Looks for a preview image embedded in the metadata of a file. Only the headers
+ * are read, the main image is never decoded.
+ *
+ * Supported are the EXIF thumbnail (IFD1) stored in the APP1 segment of a JPEG and
+ * the same EXIF data stored in the EXIF chunk of a WebP. The preview itself is
+ * always a complete JPEG.
+ *
+ * A preview is only returned if it is at least minimumSize pixels on its longest
+ * side and has the same shape as the main image. Cameras often letterbox a 3:2
+ * photo into a 160x120 thumbnail and those previews are skipped.
+ */
+bool findEmbeddedPreview(const std::string & file, int minimumSize, std::vector<unsigned char> & preview);
+
+#endif
@@ -0,0 +1,39 @@
+#include "identify.h"
+#include <stdio.h>
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_image.h>
+#include <allegro5/allegro_memfile.h>
+
+using std::string;
+
+/* Enough for the longest header the identifiers look at, TGA is 18 bytes */
+static const int HEADER_SIZE = 64;
+
+string identifyImage(const string & file){
+    FILE * in = fopen(file.c_str(), "rb");
+    if (in == nullptr){
+        return "";
+    }
+
+    unsigned char header[HEADER_SIZE];
+    size_t got = fread(header, 1, sizeof(header), in);
+    fclose(in);
+    if (got == 0){
+        return "";
+    }
+
+    /* The image addon checks the magic numbers of every format it has a loader
+     * for, so let it look at the header through a memfile.
+     */
+    ALLEGRO_FILE * memory = al_open_memfile(header, got, "r");
+    if (memory == nullptr){
+        return "";
+    }
+    const char * extension = al_identify_bitmap_f(memory);
+    al_fclose(memory);
+
+    if (extension == nullptr){
+        return "";
+    }
+    return extension;
+}
@@ -0,0 +1,12 @@
+#ifndef _viewer_identify_h
+#define _viewer_identify_h
+
+#include <string>
+
+/* Returns the extension (".png", ".jpg", ...) of the image format a file is in,
+ * or an empty string if none of the loaders registered with the image addon can
+ * read it. Only the first few bytes of the file are read, nothing is decoded.
+ */
+std::string identifyImage(const std::string & file);
+
+#endif
@@ -0,0 +1,822 @@
+#ifndef _viewer_image_manager_h
+#define _viewer_image_manager_h
+
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_image.h>
+#include <vector>
+#include <deque>
+#include <list>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+
+#include "events.h"
+#include "stats.h"
+#include "cancel.h"
+#include "jpeg.h"
+#include "tiles.h"
+
+/* Loads images in the background and returns the current image when its available.
+ *
+ * There should be N worker threads, probably 2 or 3, that just loop waiting to be
+ * given work. The work will be in the form of a filename that they should use to
+ * load a bitmap with al_load_bitmap. This will return a memory bitmap that will be
+ * sent back to the manager.
+ *
+ * The manager should create a mailbox with an atomic flag that says when the
+ * mailbox is full. The worker will place the memory bitmap in the mailbox and wake
+ * the manager with a LOAD_TYPE event, one for everything that arrived since the
+ * manager last looked.
+ *
+ * Loaded images are kept in a cache ordered by when they were last shown so going
+ * back to an image doesn't load it again. The cache is limited to a number of bytes
+ * and the least recently shown images are thrown away first. The view also tells
+ * the manager which images are likely to be shown next so they can be loaded
+ * before the user gets to them.
+ *
+ * Big jpegs are first decoded at a reduced scale, which is a lot faster, so there
+ * is something better than the thumbnail to show while the real decode runs.
+ *
+ * When the user moves on, loads that are already running for images that are
+ * not wanted anymore are cancelled. The decoders check the mailbox every few
+ * rows, so a worker stuck on a huge picture is free again almost right away.
+ *
+ * Loaded images are memory bitmaps. Turning the current one into a video bitmap
+ * is done by upload a strip of lines at a time, for a few milliseconds each frame,
+ * so a huge picture doesn't freeze the screen while its copied to the gpu.
+ */
+class ImageManager{
+public:
+    static const int MAX_WORKERS = 2;
+
+    /* Previews are decoded so their short side is at least this big */
+    static const int PREVIEW_SIZE = 480;
+
+    /* Milliseconds of uploading per call to upload, and lines copied at a time */
+    static constexpr double UPLOAD_BUDGET = 4;
+    static const int UPLOAD_LINES = 32;
+
+    /* Sends LOAD_TYPE when a worker has something for the manager. Only the
+     * first one since the manager last looked sends an event, so a burst of
+     * previews and loads is one event.
+     */
+    class Wake{
+    public:
+        Wake(ALLEGRO_EVENT_SOURCE * events):
+        events(events),
+        pending(false){
+        }
+
+        /* Called by the workers */
+        void send(){
+            if (!pending.exchange(true)){
+                ALLEGRO_EVENT event;
+                event.user.type = LOAD_TYPE;
+                al_emit_user_event(events, &event, nullptr);
+                stats.eventSent();
+            }
+        }
+
+        /* Called by the manager before it looks at the mailboxes, whatever
+         * arrives after this sends another event
+         */
+        void seen(){
+            pending.exchange(false);
+        }
+
+        ALLEGRO_EVENT_SOURCE * events;
+        std::atomic<bool> pending;
+    };
+
+    /* Written by one worker and read by the manager. Everything is atomic so
+     * neither side ever waits on the other.
+     */
+    class Mailbox: public Cancel{
+    public:
+        Mailbox(const std::string & file, Wake & wake):
+        file(file),
+        count(0),
+        wake(wake),
+        bitmap(nullptr),
+        preview(nullptr),
+        started(false),
+        done(false),
+        cancelled(false){
+        }
+
+        ~Mailbox(){
+            /* Nobody took it */
+            ALLEGRO_BITMAP * left = preview.load();
+            if (left != nullptr){
+                al_destroy_bitmap(left);
+            }
+        }
+
+        void inc(){
+            count += 1;
+        }
+
+        void dec(){
+            count -= 1;
+        }
+
+        int getCount() const {
+            return count.load();
+        }
+
+        const std::string getFile() const {
+            return file;
+        }
+
+        /* Called by a worker before loading the file. Returns false if some other
+         * worker already took care of this mailbox.
+         */
+        bool start(){
+            return !started.exchange(true);
+        }
+
+        bool isStarted() const {
+            return started.load();
+        }
+
+        /* True once a worker has tried to load the file, even if it failed */
+        bool isDone() const {
+            return done.load();
+        }
+
+        /* Tells the worker loading the file to stop, it can't be undone */
+        void cancel(){
+            cancelled.store(true);
+        }
+
+        /* Polled by the decoder while the worker loads the file */
+        virtual bool isCancelled() const {
+            return cancelled.load();
+        }
+
+        /* The worker wakes the manager once it let go of the mailbox, see
+         * Worker::work
+         */
+        void setBitmap(ALLEGRO_BITMAP * bitmap){
+            this->bitmap.store(bitmap);
+            done.store(true);
+        }
+
+        /* A reduced size version of the picture while the real one is loading */
+        void setPreview(ALLEGRO_BITMAP * bitmap){
+            ALLEGRO_BITMAP * old = preview.exchange(bitmap);
+            if (old != nullptr){
+                al_destroy_bitmap(old);
+            }
+
+            if (!isCancelled()){
+                wake.send();
+            }
+        }
+
+        /* The caller owns the preview, nullptr if there is none (anymore) */
+        ALLEGRO_BITMAP * takePreview(){
+            return preview.exchange(nullptr);
+        }
+
+        ALLEGRO_BITMAP * getBitmap(){
+            return bitmap.load();
+        }
+
+        const std::string file;
+        /* The number of tasks that reference this mailbox */
+        std::atomic<int> count;
+        Wake & wake;
+        std::atomic<ALLEGRO_BITMAP*> bitmap;
+        std::atomic<ALLEGRO_BITMAP*> preview;
+        /* Set when a worker picks up the mailbox */
+        std::atomic<bool> started;
+        /* Set when the worker is done loading */
+        std::atomic<bool> done;
+        /* Set when the file isn't wanted anymore */
+        std::atomic<bool> cancelled;
+    };
+
+    class Task{
+    public:
+        Task(Mailbox * box):
+        box(box){
+            box->inc();
+        }
+
+        ~Task(){
+            box->dec();
+        }
+
+        Mailbox * getBox(){
+            return box;
+        }
+
+        Mailbox * box;
+    };
+
+    /* Contains a list of tasks that can be taken off by workers. Workers block
+     * in getTask until there is a task or the list is stopped.
+     */
+    class TaskList{
+    public:
+        TaskList():
+        stopped(false){
+            mutex = al_create_mutex();
+            ready = al_create_cond();
+        }
+
+        ~TaskList(){
+            /* Hopefully no one is using this task list at this point. What
+             * a fun potential race! Good job c++!
+             */
+            al_destroy_cond(ready);
+            al_destroy_mutex(mutex);
+            for (Task * task: tasks){
+                delete task;
+            }
+        }
+
+        /* Pull the first task off the list, waiting for one if the list is empty.
+         * Returns nullptr once the list has been stopped. Whoever gets the task
+         * must take care to delete it.
+         */
+        Task * getTask(){
+            Task * out = nullptr;
+            al_lock_mutex(mutex);
+            while (tasks.size() == 0 && !stopped){
+                al_wait_cond(ready, mutex);
+            }
+            if (!stopped){
+                out = tasks.front();
+                tasks.pop_front();
+                stats.tasks(tasks.size());
+            }
+            al_unlock_mutex(mutex);
+            return out;
+        }
+
+        /* Replaces the work queue with the given tasks, the first one will be
+         * the next one taken.
+         */
+        void setTasks(const std::vector<Task*> & next){
+            al_lock_mutex(mutex);
+            /* We actually don't care about old tasks so just erase them */
+            for (Task * task: tasks){
+                delete task;
+            }
+            tasks.assign(next.begin(), next.end());
+            stats.tasks(tasks.size());
+            al_broadcast_cond(ready);
+            al_unlock_mutex(mutex);
+        }
+
+        /* Wakes up every worker waiting in getTask and makes them return nullptr */
+        void stop(){
+            al_lock_mutex(mutex);
+            stopped = true;
+            al_broadcast_cond(ready);
+            al_unlock_mutex(mutex);
+        }
+
+        ALLEGRO_MUTEX * mutex;
+        /* Signalled when a task is added or the list is stopped */
+        ALLEGRO_COND * ready;
+        std::deque<Task*> tasks;
+        bool stopped;
+    };
+
+    /* Loads threads in the background */
+    class Worker{
+    public:
+        Worker(TaskList & tasks, Wake & wake):
+        tasks(tasks),
+        wake(wake){
+            thread = nullptr;
+        }
+
+        /* The task list must be stopped first or this will wait forever */
+        ~Worker(){
+            al_join_thread(thread, nullptr);
+            al_destroy_thread(thread);
+        }
+
+        void start(){
+            thread = al_create_thread(run, this);
+            al_start_thread(thread);
+        }
+
+        ALLEGRO_THREAD * thread;
+        TaskList & tasks;
+        Wake & wake;
+
+        void load(Mailbox * box){
+            if (!box->start()){
+                return;
+            }
+            al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+            double start = al_get_time();
+
+            /* Only worth it if the preview is a lot smaller than the picture */
+            int width = 0;
+            int height = 0;
+            if (jpegSize(box->getFile(), width, height) && std::min(width, height) >= PREVIEW_SIZE * 2){
+                ALLEGRO_BITMAP * preview = loadScaledJpeg(box->getFile(), PREVIEW_SIZE, box);
+                if (preview != nullptr){
+                    stats.previewed((al_get_time() - start) * 1000);
+                    box->setPreview(preview);
+                }
+            }
+
+            ALLEGRO_BITMAP * out = nullptr;
+            if (isHuge(width, height)){
+                /* Too big for a texture, the view zooms into it with a TiledImage */
+                out = loadFittedJpeg(box->getFile(), HUGE_FIT, box);
+            } else {
+                out = loadCancellable(box->getFile(), *box);
+            }
+            if (out == nullptr && box->isCancelled()){
+                stats.loadCancelled((al_get_time() - start) * 1000);
+            } else {
+                stats.loaded((al_get_time() - start) * 1000);
+            }
+            box->setBitmap(out);
+        }
+
+        void work(){
+            /* getTask will sleep until theres something ready and returns
+             * nullptr when its time to quit.
+             */
+            Task * next = tasks.getTask();
+            while (next != nullptr){
+                Mailbox * box = next->getBox();
+                load(box);
+                bool wanted = !box->isCancelled();
+
+                /* We are done with the task. The manager only collects the
+                 * mailbox once no task has it, so it is woken after this.
+                 */
+                delete next;
+                if (wanted){
+                    wake.send();
+                }
+                next = tasks.getTask();
+            }
+        }
+
+        static void * run(ALLEGRO_THREAD * thread, void * self){
+            Worker * worker = (Worker*) self;
+            worker->work();
+            return nullptr;
+        }
+    };
+
+    /* A loaded image kept around in case its shown again */
+    struct Cached{
+        std::string file;
+        /* nullptr if the file couldn't be loaded */
+        ALLEGRO_BITMAP * bitmap;
+        size_t bytes;
+        /* Set once the bitmap was uploaded, or it couldn't be and stays in memory */
+        bool ready;
+    };
+
+    /* The video bitmap the current image is being copied to */
+    struct Upload{
+        Upload():
+        from(nullptr),
+        to(nullptr),
+        line(0),
+        time(0){
+        }
+
+        std::string file;
+        ALLEGRO_BITMAP * from;
+        ALLEGRO_BITMAP * to;
+        /* Lines copied so far */
+        int line;
+        /* Milliseconds spent so far */
+        double time;
+    };
+
+    /* Default size of the cache of loaded images */
+    static const size_t DEFAULT_CACHE_BYTES = 256 * 1024 * 1024;
+
+    ImageManager(ALLEGRO_EVENT_SOURCE * events):
+    cacheBytes(0),
+    cacheBudget(DEFAULT_CACHE_BYTES),
+    previewBitmap(nullptr),
+    events(events),
+    wake(events){
+        for (int i = 0; i < MAX_WORKERS; i++){
+            Worker * worker = new Worker(tasks, wake);
+            worker->start();
+            workers.push_back(worker);
+        }
+    }
+
+    ~ImageManager(){
+        /* Don't wait for loads to finish */
+        for (Mailbox * box: mailboxes){
+            box->cancel();
+        }
+
+        /* We kill all the workers so in theory there should be no one using
+         * the task list when its destructor runs.
+         */
+        tasks.stop();
+        for (Worker * worker: workers){
+            delete worker;
+        }
+
+        /* There is an interesting race here. The task list class will delete all
+         * existing tasks but they are referencing mailboxes. We can't delete the
+         * mailboxes first because the Task destructor will call box->dec(). We need
+         * to somehow delete the mailboxes after the task list destructor runs.
+         * I suppose the task list could be made a pointer so we can manually
+         * schedule its deletion and then delete all the remaining mailboxes afterwards.
+         *
+         * In reality the number of tasks/mailboxes will be pretty small since workers
+         * only hold onto 1 task at a time and the task list only contains the
+         * current image and the prefetched ones.
+         */
+
+        stopUpload();
+        for (Cached & cached: cache){
+            if (cached.bitmap != nullptr){
+                al_destroy_bitmap(cached.bitmap);
+            }
+        }
+
+        dropPreview();
+    }
+
+    void setCacheBudget(size_t bytes){
+        cacheBudget = bytes;
+        trimCache();
+    }
+
+    /* Delete any mailboxes that no task references anymore and dont match a
+     * file we want, and cancel the ones for files we don't want that a worker
+     * is loading right now.
+     */
+    void cleanOldMailboxes(const std::vector<std::string> & wanted){
+        /* C++11 note: Not sure if its a good idea to use auto here.
+         * Also, can we not use ranged for because we might delete something while iterating?
+         */
+        for (auto it = mailboxes.begin(); it != mailboxes.end(); /**/){
+            Mailbox * box = *it;
+
+            /* Delete the mailbox if it uses a file we dont care about
+             * and its not reference by a task because the task was removed
+             * from the queue before it was started.
+             *
+             * The mailbox might be reference by a task currently being processed
+             * by a worker and so the count will be non-zero.
+             */
+            bool unwanted = std::find(wanted.begin(), wanted.end(), box->getFile()) == wanted.end();
+            if (unwanted && box->getCount() == 0 && !box->isDone()){
+                delete box;
+                it = mailboxes.erase(it);
+            } else if (unwanted && !box->isDone()){
+                /* The worker still uses the mailbox so it is kept until the
+                 * worker is done with it. If the file is wanted again later it
+                 * gets a new mailbox.
+                 */
+                box->cancel();
+                cancelled.push_back(box);
+                it = mailboxes.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    /* Puts what a finished mailbox loaded in the cache. A cancelled load might
+     * have finished anyway, but if it didn't the failure must not be cached. If
+     * the file was wanted again while it was cancelled a second mailbox could
+     * have loaded it already.
+     */
+    void collect(Mailbox * box){
+        ALLEGRO_BITMAP * bitmap = box->getBitmap();
+        if (findCached(box->getFile()) != cache.end()){
+            if (bitmap != nullptr){
+                al_destroy_bitmap(bitmap);
+            }
+        } else if (bitmap != nullptr || !box->isCancelled()){
+            remember(box->getFile(), bitmap);
+        }
+    }
+
+    /* Move loaded bitmaps out of their mailboxes and into the cache */
+    void collectMailboxes(){
+        wake.seen();
+        for (std::vector<Mailbox*> * boxes: {&mailboxes, &cancelled}){
+            for (auto it = boxes->begin(); it != boxes->end(); /**/){
+                Mailbox * box = *it;
+                /* The worker is done with the mailbox once its task is deleted */
+                if (box->isDone() && box->getCount() == 0){
+                    collect(box);
+                    delete box;
+                    it = boxes->erase(it);
+                } else {
+                    it++;
+                }
+            }
+        }
+    }
+
+    std::list<Cached>::iterator findCached(const std::string & file){
+        for (auto it = cache.begin(); it != cache.end(); it++){
+            if (it->file == file){
+                return it;
+            }
+        }
+        return cache.end();
+    }
+
+    Mailbox * findMailbox(const std::string & file){
+        for (Mailbox * box: mailboxes){
+            if (box->getFile() == file){
+                return box;
+            }
+        }
+        return nullptr;
+    }
+
+    /* Put a loaded bitmap at the front of the cache */
+    void remember(const std::string & file, ALLEGRO_BITMAP * bitmap){
+        Cached cached;
+        cached.file = file;
+        cached.bitmap = bitmap;
+        cached.bytes = 0;
+        cached.ready = bitmap == nullptr;
+        if (bitmap != nullptr){
+            cached.bytes = (size_t) al_get_bitmap_width(bitmap) * al_get_bitmap_height(bitmap) * 4;
+        }
+        cache.push_front(cached);
+        cacheBytes += cached.bytes;
+        trimCache();
+    }
+
+    /* Throw away the least recently used images until the cache fits in its
+     * budget. The current image is always kept even if its larger than the budget.
+     */
+    void trimCache(){
+        auto it = cache.end();
+        while (cacheBytes > cacheBudget && it != cache.begin()){
+            it--;
+            if (it->file == currentFile){
+                continue;
+            }
+            if (it->bitmap != nullptr && it->bitmap == uploading.from){
+                stopUpload();
+            }
+            if (it->bitmap != nullptr){
+                al_destroy_bitmap(it->bitmap);
+            }
+            cacheBytes -= it->bytes;
+            it = cache.erase(it);
+        }
+    }
+
+    /* Make the task list match the current image and the prefetched ones */
+    void schedule(){
+        std::vector<std::string> wanted;
+        wanted.push_back(currentFile);
+        wanted.insert(wanted.end(), prefetchFiles.begin(), prefetchFiles.end());
+
+        std::vector<Task*> next;
+        for (const std::string & file: wanted){
+            if (findCached(file) != cache.end()){
+                continue;
+            }
+
+            Mailbox * box = findMailbox(file);
+            if (box == nullptr){
+                box = new Mailbox(file, wake);
+                mailboxes.push_back(box);
+            }
+
+            /* If a worker already has the mailbox its loading or loaded */
+            if (!box->isStarted()){
+                next.push_back(new Task(box));
+            }
+        }
+
+        tasks.setTasks(next);
+        cleanOldMailboxes(wanted);
+    }
+
+    /* Sets the current image and the ones that should be loaded after it, in
+     * the order they are likely to be shown.
+     */
+    void prefetch(const std::string & current, const std::vector<std::string> & files){
+        currentFile = current;
+        prefetchFiles = files;
+        schedule();
+    }
+
+    void dropPreview(){
+        if (previewBitmap != nullptr){
+            al_destroy_bitmap(previewBitmap);
+            previewBitmap = nullptr;
+        }
+        previewFile = "";
+    }
+
+    /* The latest reduced size version of the file while it is still loading,
+     * nullptr if there isn't one yet. Call get first.
+     */
+    ALLEGRO_BITMAP * getPreview(const std::string & filename){
+        if (filename != previewFile){
+            dropPreview();
+            previewFile = filename;
+        }
+
+        Mailbox * box = findMailbox(filename);
+        ALLEGRO_BITMAP * newer = box != nullptr ? box->takePreview() : nullptr;
+        if (newer != nullptr){
+            if (previewBitmap != nullptr){
+                al_destroy_bitmap(previewBitmap);
+            }
+            previewBitmap = newer;
+
+            /* Its drawn bigger than it is so filter it */
+            int oldFlags = al_get_new_bitmap_flags();
+            al_set_new_bitmap_flags(ALLEGRO_VIDEO_BITMAP | ALLEGRO_MIN_LINEAR | ALLEGRO_MAG_LINEAR);
+            double start = al_get_time();
+            al_convert_bitmap(previewBitmap);
+            stats.uploaded((al_get_time() - start) * 1000);
+            al_set_new_bitmap_flags(oldFlags);
+        }
+
+        return previewBitmap;
+    }
+
+    ALLEGRO_BITMAP * get(const std::string & filename){
+        collectMailboxes();
+
+        if (filename != currentFile){
+            currentFile = filename;
+            schedule();
+        }
+
+        auto found = findCached(filename);
+        if (found == cache.end()){
+            /* Still loading */
+            return nullptr;
+        }
+
+        /* Move it to the front since it was just used */
+        cache.splice(cache.begin(), cache, found);
+        if (!cache.front().ready){
+            /* Loaded but upload hasn't copied all of it yet */
+            return nullptr;
+        }
+
+        /* The real thing is here */
+        if (filename == previewFile){
+            dropPreview();
+        }
+
+        return cache.front().bitmap;
+    }
+
+    /* True if the file was loaded and couldn't be decoded */
+    bool failed(const std::string & filename){
+        auto found = findCached(filename);
+        return found != cache.end() && found->bitmap == nullptr;
+    }
+
+    void stopUpload(){
+        if (uploading.to != nullptr){
+            al_destroy_bitmap(uploading.to);
+        }
+        uploading = Upload();
+    }
+
+    /* Creates the video bitmap for the upload, false if there can't be one */
+    bool startUpload(Cached & cached){
+        stopUpload();
+
+        int oldFlags = al_get_new_bitmap_flags();
+        int oldFormat = al_get_new_bitmap_format();
+        al_set_new_bitmap_flags((oldFlags & ~(ALLEGRO_MEMORY_BITMAP | ALLEGRO_CONVERT_BITMAP)) | ALLEGRO_VIDEO_BITMAP);
+        al_set_new_bitmap_format(al_get_bitmap_format(cached.bitmap));
+        ALLEGRO_BITMAP * to = al_create_bitmap(al_get_bitmap_width(cached.bitmap), al_get_bitmap_height(cached.bitmap));
+        al_set_new_bitmap_format(oldFormat);
+        al_set_new_bitmap_flags(oldFlags);
+
+        if (to == nullptr){
+            return false;
+        }
+
+        uploading.file = cached.file;
+        uploading.from = cached.bitmap;
+        uploading.to = to;
+        return true;
+    }
+
+    /* Copies lines of the upload until the budget is used up. Returns false if
+     * the bitmaps can't be locked.
+     */
+    bool copyLines(double budget){
+        double start = al_get_time();
+        int width = al_get_bitmap_width(uploading.from);
+        int height = al_get_bitmap_height(uploading.from);
+
+        ALLEGRO_LOCKED_REGION * from = al_lock_bitmap(uploading.from, ALLEGRO_PIXEL_FORMAT_ANY, ALLEGRO_LOCK_READONLY);
+        if (from == nullptr){
+            return false;
+        }
+
+        while (uploading.line < height && (al_get_time() - start) * 1000 < budget){
+            int lines = height - uploading.line;
+            if (lines > UPLOAD_LINES){
+                lines = UPLOAD_LINES;
+            }
+            /* Only the locked lines are sent to the gpu when it is unlocked */
+            ALLEGRO_LOCKED_REGION * to = al_lock_bitmap_region(uploading.to, 0, uploading.line, width, lines, from->format, ALLEGRO_LOCK_WRITEONLY);
+            if (to == nullptr){
+                al_unlock_bitmap(uploading.from);
+                return false;
+            }
+            for (int y = 0; y < lines; y++){
+                memcpy((char *) to->data + y * to->pitch,
+                       (const char *) from->data + (uploading.line + y) * from->pitch,
+                       width * from->pixel_size);
+            }
+            al_unlock_bitmap(uploading.to);
+            uploading.line += lines;
+        }
+
+        al_unlock_bitmap(uploading.from);
+        uploading.time += (al_get_time() - start) * 1000;
+        return true;
+    }
+
+    /* Uploads part of the current image if it is loaded but still a memory
+     * bitmap. Call once per frame from the thread that draws. Returns true when
+     * the image just became ready, get returns it from then on. If there is more
+     * to upload a LOAD_TYPE event is sent so there is another frame.
+     */
+    bool upload(double budget = UPLOAD_BUDGET){
+        collectMailboxes();
+
+        auto found = findCached(currentFile);
+        if (found == cache.end() || found->ready){
+            /* Anything still uploading is for an image that isn't shown anymore */
+            stopUpload();
+            return false;
+        }
+
+        if ((uploading.from != found->bitmap && !startUpload(*found)) || !copyLines(budget)){
+            /* Too big for a texture, drawn from memory */
+            stopUpload();
+            found->ready = true;
+            return true;
+        }
+
+        if (uploading.line < al_get_bitmap_height(found->bitmap)){
+            ALLEGRO_EVENT event;
+            event.user.type = LOAD_TYPE;
+            al_emit_user_event(events, &event, nullptr);
+            stats.eventSent();
+            return false;
+        }
+
+        stats.uploaded(uploading.time);
+        al_destroy_bitmap(found->bitmap);
+        found->bitmap = uploading.to;
+        found->ready = true;
+        uploading.to = nullptr;
+        stopUpload();
+        return true;
+    }
+
+    std::vector<Worker*> workers;
+    std::vector<Mailbox*> mailboxes;
+    /* Mailboxes of cancelled loads that a worker might still be using */
+    std::vector<Mailbox*> cancelled;
+    TaskList tasks;
+
+    /* Most recently used first */
+    std::list<Cached> cache;
+    size_t cacheBytes;
+    size_t cacheBudget;
+
+    std::string currentFile;
+    std::vector<std::string> prefetchFiles;
+
+    Upload uploading;
+
+    /* See getPreview */
+    std::string previewFile;
+    ALLEGRO_BITMAP * previewBitmap;
+    ALLEGRO_EVENT_SOURCE * events;
+    Wake wake;
+};
+
+#endif
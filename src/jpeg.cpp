@@ -0,0 +1,311 @@
+#include "jpeg.h"
+#include "cancel.h"
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <vector>
+
+using std::string;
+
+// #define debug(...) printf(__VA_ARGS__)
+#define debug(...)
+
+/* libjpeg reports fatal errors by calling error_exit, which must not return. */
+struct JpegError{
+    jpeg_error_mgr manager;
+    jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr info){
+    JpegError * error = (JpegError *) info->err;
+    longjmp(error->jump, 1);
+}
+
+static void jpegOutputMessage(j_common_ptr info){
+    /* Warnings about corrupt data would otherwise go to stderr */
+}
+
+static bool isJpeg(FILE * file){
+    unsigned char magic[3];
+    bool out = fread(magic, 1, 3, file) == 3 &&
+               magic[0] == 0xff && magic[1] == 0xd8 && magic[2] == 0xff;
+    rewind(file);
+    return out;
+}
+
+/* Largest denominator that keeps the short side at least minimumSize */
+static int pickScale(int width, int height, int minimumSize){
+    int shortest = width < height ? width : height;
+    for (int denominator = 8; denominator > 1; denominator /= 2){
+        /* libjpeg rounds scaled sizes up */
+        if ((shortest + denominator - 1) / denominator >= minimumSize){
+            return denominator;
+        }
+    }
+    return 1;
+}
+
+/* Smallest denominator that gets the long side down to maximumSize, or the
+ * largest one there is if none do
+ */
+static int pickFit(int width, int height, int maximumSize){
+    int longest = width > height ? width : height;
+    for (int denominator = 1; denominator < 8; denominator *= 2){
+        if ((longest + denominator - 1) / denominator <= maximumSize){
+            return denominator;
+        }
+    }
+    return 8;
+}
+
+/* Rows decoded between looking at the cancel flag, a row of blocks */
+static const unsigned int CANCEL_ROWS = 16;
+
+/* Everything that has to be cleaned up if libjpeg bails out. Kept out of the
+ * function that calls setjmp so nothing is clobbered by the longjmp.
+ */
+struct JpegDecode{
+    JpegDecode():
+    file(nullptr),
+    bitmap(nullptr),
+    locked(false),
+    minimumSize(0),
+    maximumSize(0),
+    fast(true),
+    cancel(nullptr),
+    rows(nullptr){
+    }
+
+    jpeg_decompress_struct info;
+    JpegError error;
+    FILE * file;
+    ALLEGRO_BITMAP * bitmap;
+    bool locked;
+    /* What libjpeg writes if it can't write RGBA itself */
+    std::vector<unsigned char> row;
+    /* A line of RGBA pixels for rows */
+    std::vector<unsigned char> line;
+    /* The scale to decode at, see pickScale and pickFit. Full size if both are 0. */
+    int minimumSize;
+    int maximumSize;
+    /* Trade quality for speed, for pictures that are going to be shrunk */
+    bool fast;
+    const Cancel * cancel;
+    /* Gets the lines instead of a bitmap if set */
+    JpegRows * rows;
+};
+
+/* Reads the next scanline as RGBA pixels */
+static void readLine(JpegDecode & decode, unsigned char * line){
+    jpeg_decompress_struct & info = decode.info;
+#ifdef JCS_EXTENSIONS
+    JSAMPROW rows[1] = {line};
+    jpeg_read_scanlines(&info, rows, 1);
+#else
+    JSAMPROW rows[1] = {&decode.row[0]};
+    jpeg_read_scanlines(&info, rows, 1);
+    const unsigned char * in = &decode.row[0];
+    bool gray = info.output_components == 1;
+    for (unsigned int x = 0; x < info.output_width; x++){
+        if (gray){
+            line[0] = line[1] = line[2] = in[0];
+            in += 1;
+        } else {
+            line[0] = in[0];
+            line[1] = in[1];
+            line[2] = in[2];
+            in += 3;
+        }
+        line[3] = 255;
+        line += 4;
+    }
+#endif
+}
+
+static bool decode(JpegDecode & decode){
+    jpeg_decompress_struct & info = decode.info;
+
+    jpeg_stdio_src(&info, decode.file);
+    jpeg_read_header(&info, TRUE);
+
+    if (info.jpeg_color_space == JCS_CMYK || info.jpeg_color_space == JCS_YCCK){
+        debug("Can't decode a CMYK jpeg to RGB\n");
+        return false;
+    }
+
+    info.scale_num = 1;
+    info.scale_denom = 1;
+    if (decode.maximumSize > 0){
+        info.scale_denom = pickFit(info.image_width, info.image_height, decode.maximumSize);
+    } else if (decode.minimumSize > 0){
+        info.scale_denom = pickScale(info.image_width, info.image_height, decode.minimumSize);
+    }
+#ifdef JCS_EXTENSIONS
+    /* libjpeg-turbo can write the same byte order as ABGR_8888_LE directly */
+    info.out_color_space = JCS_EXT_RGBA;
+#else
+    info.out_color_space = JCS_RGB;
+#endif
+    if (decode.fast){
+        /* Quality barely matters when the result is shrunk to a thumbnail */
+        info.dct_method = JDCT_IFAST;
+        info.do_fancy_upsampling = FALSE;
+    }
+
+    jpeg_start_decompress(&info);
+    debug("Decoding %dx%d jpeg at 1/%d: %dx%d\n", info.image_width, info.image_height, info.scale_denom, info.output_width, info.output_height);
+
+#ifndef JCS_EXTENSIONS
+    decode.row.resize(info.output_width * info.output_components);
+#endif
+
+    ALLEGRO_LOCKED_REGION * region = nullptr;
+    if (decode.rows != nullptr){
+        if (!decode.rows->size(info.output_width, info.output_height)){
+            return false;
+        }
+        decode.line.resize(info.output_width * 4);
+    } else {
+        decode.bitmap = al_create_bitmap(info.output_width, info.output_height);
+        if (decode.bitmap == nullptr){
+            return false;
+        }
+
+        region = al_lock_bitmap(decode.bitmap, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+        if (region == nullptr){
+            return false;
+        }
+        decode.locked = true;
+    }
+
+    while (info.output_scanline < info.output_height){
+        if (decode.cancel != nullptr && info.output_scanline % CANCEL_ROWS == 0 && decode.cancel->isCancelled()){
+            debug("Cancelled at line %d of %d\n", info.output_scanline, info.output_height);
+            return false;
+        }
+
+        if (region != nullptr){
+            readLine(decode, (unsigned char *) region->data + info.output_scanline * region->pitch);
+        } else {
+            readLine(decode, &decode.line[0]);
+            if (!decode.rows->row(&decode.line[0])){
+                return false;
+            }
+        }
+    }
+
+    if (region != nullptr){
+        al_unlock_bitmap(decode.bitmap);
+        decode.locked = false;
+    }
+
+    jpeg_finish_decompress(&info);
+    return true;
+}
+
+/* Opens the file and decodes it as the state says */
+static bool run(const string & file, JpegDecode & state){
+    state.file = fopen(file.c_str(), "rb");
+    if (state.file == nullptr){
+        return false;
+    }
+
+    if (!isJpeg(state.file)){
+        fclose(state.file);
+        return false;
+    }
+
+    state.info.err = jpeg_std_error(&state.error.manager);
+    state.error.manager.error_exit = jpegErrorExit;
+    state.error.manager.output_message = jpegOutputMessage;
+    jpeg_create_decompress(&state.info);
+
+    bool ok = false;
+    if (setjmp(state.error.jump) == 0){
+        ok = decode(state);
+    }
+
+    if (state.locked){
+        al_unlock_bitmap(state.bitmap);
+    }
+    if (!ok && state.bitmap != nullptr){
+        al_destroy_bitmap(state.bitmap);
+        state.bitmap = nullptr;
+    }
+
+    jpeg_destroy_decompress(&state.info);
+    fclose(state.file);
+
+    return ok;
+}
+
+/* Kept out of the function that calls setjmp like decode */
+static void readSize(JpegDecode & decode, int & width, int & height){
+    jpeg_stdio_src(&decode.info, decode.file);
+    jpeg_read_header(&decode.info, TRUE);
+    width = decode.info.image_width;
+    height = decode.info.image_height;
+}
+
+bool jpegSize(const string & file, int & width, int & height){
+    JpegDecode state;
+
+    state.file = fopen(file.c_str(), "rb");
+    if (state.file == nullptr){
+        return false;
+    }
+
+    if (!isJpeg(state.file)){
+        fclose(state.file);
+        return false;
+    }
+
+    state.info.err = jpeg_std_error(&state.error.manager);
+    state.error.manager.error_exit = jpegErrorExit;
+    state.error.manager.output_message = jpegOutputMessage;
+    jpeg_create_decompress(&state.info);
+
+    bool ok = false;
+    if (setjmp(state.error.jump) == 0){
+        readSize(state, width, height);
+        ok = true;
+    }
+
+    jpeg_destroy_decompress(&state.info);
+    fclose(state.file);
+    return ok;
+}
+
+ALLEGRO_BITMAP * loadScaledJpeg(const string & file, int minimumSize, const Cancel * cancel){
+    JpegDecode state;
+    state.minimumSize = minimumSize;
+    state.cancel = cancel;
+    run(file, state);
+    return state.bitmap;
+}
+
+ALLEGRO_BITMAP * loadJpeg(const string & file, const Cancel * cancel){
+    JpegDecode state;
+    state.fast = false;
+    state.cancel = cancel;
+    run(file, state);
+    return state.bitmap;
+}
+
+ALLEGRO_BITMAP * loadFittedJpeg(const string & file, int maximumSize, const Cancel * cancel){
+    JpegDecode state;
+    state.maximumSize = maximumSize;
+    state.fast = false;
+    state.cancel = cancel;
+    run(file, state);
+    return state.bitmap;
+}
+
+bool readJpegRows(const string & file, JpegRows & rows, const Cancel * cancel){
+    JpegDecode state;
+    state.fast = false;
+    state.cancel = cancel;
+    state.rows = &rows;
+    return run(file, state);
+}
@@ -0,0 +1,52 @@
+#ifndef _viewer_jpeg_h
+#define _viewer_jpeg_h
+
+#include <allegro5/allegro.h>
+#include <string>
+
+class Cancel;
+
+/* Decodes a jpeg with libjpeg directly instead of going through al_load_bitmap.
+ *
+ * libjpeg can skip most of the work of the inverse DCT and decode at 1/2, 1/4 or
+ * 1/8 of the full size. This picks the smallest of those scales that still leaves
+ * the short side of the image at least minimumSize pixels, so a 6000x4000 photo
+ * thumbnailed at 80 pixels is decoded at 750x500.
+ *
+ * The bitmap is created with the current new bitmap flags. Returns nullptr if the
+ * file is not a jpeg or can't be decoded to RGB (CMYK for example), in which case
+ * the caller should fall back to al_load_bitmap. If cancel is given the decode
+ * gives up and returns nullptr as soon as it is cancelled.
+ */
+ALLEGRO_BITMAP * loadScaledJpeg(const std::string & file, int minimumSize, const Cancel * cancel = nullptr);
+
+/* Reads just the size of a jpeg. Returns false if the file is not a jpeg. */
+bool jpegSize(const std::string & file, int & width, int & height);
+
+/* Same as loadScaledJpeg but always decodes the whole picture at full quality */
+ALLEGRO_BITMAP * loadJpeg(const std::string & file, const Cancel * cancel);
+
+/* Decodes at full quality and the smallest scale that makes the long side at
+ * most maximumSize. Pictures more than 8 times bigger than that stay bigger.
+ */
+ALLEGRO_BITMAP * loadFittedJpeg(const std::string & file, int maximumSize, const Cancel * cancel);
+
+/* Gets the lines of a jpeg one at a time, for pictures too big to keep in memory */
+class JpegRows{
+public:
+    virtual ~JpegRows(){
+    }
+
+    /* Called before the first line, return false to stop */
+    virtual bool size(int width, int height) = 0;
+
+    /* The next line as RGBA (ABGR_8888_LE) pixels, return false to stop */
+    virtual bool row(const unsigned char * pixels) = 0;
+};
+
+/* Decodes the whole picture at full quality into rows. Returns false if the file
+ * is not a jpeg, can't be decoded, was cancelled or rows said to stop.
+ */
+bool readJpegRows(const std::string & file, JpegRows & rows, const Cancel * cancel);
+
+#endif
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <allegro5/allegro.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+#include "levels.h"
+#include "load.h"
+#include "events.h"
+#include "stats.h"
+
+using std::vector;
+using std::string;
+
+// #define debug(...) printf(__VA_ARGS__)
+#define debug(...)
+
+/* Decoding is the slow part and the main image loader has its own threads */
+static const int LEVEL_THREADS = 2;
+
+int levelFor(int size){
+    int levels = sizeof(LEVEL_SIZES) / sizeof(int);
+    for (int i = 0; i < levels; i++){
+        if (LEVEL_SIZES[i] >= size){
+            return LEVEL_SIZES[i];
+        }
+    }
+    return LEVEL_SIZES[levels - 1];
+}
+
+ThumbnailLevels::ThumbnailLevels(ALLEGRO_EVENT_SOURCE * events):
+events(events),
+stopped(false){
+    mutex = al_create_mutex();
+    ready = al_create_cond();
+    for (int i = 0; i < LEVEL_THREADS; i++){
+        ALLEGRO_THREAD * thread = al_create_thread(run, this);
+        if (thread != nullptr){
+            al_start_thread(thread);
+            threads.push_back(thread);
+        }
+    }
+}
+
+ThumbnailLevels::~ThumbnailLevels(){
+    al_lock_mutex(mutex);
+    stopped = true;
+    al_broadcast_cond(ready);
+    al_unlock_mutex(mutex);
+
+    for (ALLEGRO_THREAD * thread: threads){
+        al_join_thread(thread, nullptr);
+        al_destroy_thread(thread);
+    }
+
+    al_destroy_cond(ready);
+    al_destroy_mutex(mutex);
+}
+
+/* Must hold the mutex */
+bool ThumbnailLevels::building(const Request & request) const {
+    for (const Request & check: busy){
+        if (check.image == request.image && check.size == request.size){
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThumbnailLevels::request(const vector<Request> & wanted){
+    al_lock_mutex(mutex);
+    pending.clear();
+    for (const Request & request: wanted){
+        if (!building(request)){
+            pending.push_back(request);
+        }
+    }
+    al_broadcast_cond(ready);
+    al_unlock_mutex(mutex);
+}
+
+void * ThumbnailLevels::run(ALLEGRO_THREAD * self, void * data){
+    ThumbnailLevels * levels = (ThumbnailLevels*) data;
+    levels->work();
+    return nullptr;
+}
+
+void ThumbnailLevels::work(){
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+
+    while (true){
+        Request next;
+        al_lock_mutex(mutex);
+        while (pending.size() == 0 && !stopped){
+            al_wait_cond(ready, mutex);
+        }
+        if (stopped){
+            al_unlock_mutex(mutex);
+            break;
+        }
+        next = pending.front();
+        pending.pop_front();
+        busy.push_back(next);
+        al_unlock_mutex(mutex);
+
+        debug("Build level %d for %s\n", next.size, next.file.c_str());
+        ALLEGRO_BITMAP * bitmap = nullptr;
+        ALLEGRO_BITMAP * source = load_thumbnail_source(next.file, next.size);
+        if (source != nullptr){
+            bitmap = create_thumbnail(source, next.size);
+            al_destroy_bitmap(source);
+        }
+
+        al_lock_mutex(mutex);
+        for (unsigned int i = 0; i < busy.size(); i++){
+            if (busy[i].image == next.image && busy[i].size == next.size){
+                busy.erase(busy.begin() + i);
+                break;
+            }
+        }
+        al_unlock_mutex(mutex);
+
+        if (quitting()){
+            if (bitmap != nullptr){
+                al_destroy_bitmap(bitmap);
+            }
+            break;
+        }
+
+        LevelResult * result = new LevelResult();
+        result->image = next.image;
+        result->size = next.size;
+        result->bitmap = bitmap;
+
+        ALLEGRO_EVENT event;
+        event.user.type = LEVEL_TYPE;
+        event.user.data1 = (intptr_t) result;
+        al_emit_user_event(events, &event, nullptr);
+        stats.eventSent();
+    }
+}
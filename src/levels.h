@@ -0,0 +1,67 @@
+#ifndef _viewer_levels_h
+#define _viewer_levels_h
+
+#include <allegro5/allegro.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+struct Image;
+
+/* Thumbnails come in a few sizes (levels) so the grid looks sharp at any size
+ * without keeping big thumbnails for every file. The level used is the smallest
+ * one at least as big as the grid cells.
+ *
+ * Levels up to THUMBNAIL_SIZE are made from the normal thumbnail when it is put
+ * in the atlas. Bigger levels have to come from the file, so ThumbnailLevels
+ * builds those in the background for the thumbnails on screen.
+ */
+const int LEVEL_SIZES[] = {64, 128, 256};
+
+/* The level to use for a grid cell of the given size */
+int levelFor(int size);
+
+/* Sent with LEVEL_TYPE. The image pointer is only used to find the image again,
+ * whoever gets the event owns the bitmap, which is nullptr if the file couldn't
+ * be loaded.
+ */
+struct LevelResult{
+    Image * image;
+    int size;
+    ALLEGRO_BITMAP * bitmap;
+};
+
+class ThumbnailLevels{
+public:
+    ThumbnailLevels(ALLEGRO_EVENT_SOURCE * events);
+    ~ThumbnailLevels();
+
+    struct Request{
+        Image * image;
+        std::string file;
+        int size;
+    };
+
+    /* Replaces the levels waiting to be built, the first one is built first.
+     * Anything that was asked for before and isn't in the list is dropped.
+     */
+    void request(const std::vector<Request> & wanted);
+
+protected:
+    static void * run(ALLEGRO_THREAD * self, void * data);
+    void work();
+    bool building(const Request & request) const;
+
+    ALLEGRO_EVENT_SOURCE * events;
+    std::vector<ALLEGRO_THREAD*> threads;
+
+    ALLEGRO_MUTEX * mutex;
+    /* Signalled when there are new requests or its time to stop */
+    ALLEGRO_COND * ready;
+    std::deque<Request> pending;
+    /* Requests the threads are working on right now */
+    std::vector<Request> busy;
+    bool stopped;
+};
+
+#endif
@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_image.h>
+#include <allegro5/allegro_memfile.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <iostream>
+
+#include "load.h"
+#include "cache.h"
+#include "exif.h"
+#include "jpeg.h"
+#include "scan.h"
+#include "identify.h"
+#include "stats.h"
+#include "resize.h"
+#include "arena.h"
+
+using std::vector;
+using std::string;
+
+// #define debug(...) printf(__VA_ARGS__)
+#define debug(...)
+
+ALLEGRO_MUTEX * globalQuit;
+bool doQuit = false;
+
+ALLEGRO_BITMAP * create_thumbnail(ALLEGRO_BITMAP * image, int size){
+    double scale = 1;
+
+    double scaleWidth = (double) size / al_get_bitmap_width(image);
+    double scaleHeight = (double) size / al_get_bitmap_height(image);
+
+    if (scaleHeight < scaleWidth){
+        scale = scaleHeight;
+    } else {
+        scale = scaleWidth;
+    }
+    int width = std::max(1, (int)(al_get_bitmap_width(image) * scale));
+    int height = std::max(1, (int)(al_get_bitmap_height(image) * scale));
+
+    /* Shrinking averages every pixel, which is faster and looks a lot better
+     * than drawing the image scaled. Only small images get scaled up.
+     */
+    if (scale < 1){
+        ALLEGRO_BITMAP * thumbnail = shrinkBitmap(image, width, height);
+        if (thumbnail != nullptr){
+            return thumbnail;
+        }
+    }
+
+    ALLEGRO_BITMAP * thumbnail = al_create_bitmap(width, height);
+    al_set_target_bitmap(thumbnail);
+    al_clear_to_color(al_map_rgba_f(0, 0, 0, 0));
+    al_draw_scaled_bitmap(image,
+                          0, 0,
+                          al_get_bitmap_width(image),
+                          al_get_bitmap_height(image),
+                          0, 0,
+                          al_get_bitmap_width(thumbnail),
+                          al_get_bitmap_height(thumbnail),
+                          0);
+    return thumbnail;
+}
+
+/* Loads the picture that a thumbnail is made from. Most camera jpegs carry a small
+ * preview in their EXIF data which is much cheaper to decode than the photo itself,
+ * so use that if its big enough. Otherwise jpegs are decoded at a reduced scale and
+ * only other formats go through al_load_bitmap at full size.
+ */
+ALLEGRO_BITMAP * load_thumbnail_source(const string & file, int size){
+    vector<unsigned char> preview;
+    if (findEmbeddedPreview(file, size, preview)){
+        ALLEGRO_FILE * memory = al_open_memfile(&preview[0], preview.size(), "r");
+        if (memory != nullptr){
+            ALLEGRO_BITMAP * out = al_load_bitmap_f(memory, ".jpg");
+            al_fclose(memory);
+            if (out != nullptr){
+                return out;
+            }
+        }
+    }
+
+    ALLEGRO_BITMAP * scaled = loadScaledJpeg(file, size);
+    if (scaled != nullptr){
+        return scaled;
+    }
+
+    return al_load_bitmap(file.c_str());
+}
+
+/* Shared state between loadFiles and its thumbnail workers.
+ *
+ * Each worker takes the next file off the queue, makes its thumbnail and adds it
+ * to the results for the view. The thumbnails arrive in whatever order the workers
+ * finish in and the view puts them in sorted order.
+ */
+struct ThumbnailJob{
+    ThumbnailJob(FileQueue & files, ThumbnailCache & cache, ThumbnailArena & arena, ThumbnailResults & results, ALLEGRO_EVENT_SOURCE * events):
+    files(files),
+    cache(cache),
+    arena(arena),
+    results(results),
+    events(events),
+    done(0),
+    percent(0),
+    stopped(false){
+        mutex = al_create_mutex();
+    }
+
+    ~ThumbnailJob(){
+        al_destroy_mutex(mutex);
+    }
+
+    FileQueue & files;
+    ThumbnailCache & cache;
+    ThumbnailArena & arena;
+    ThumbnailResults & results;
+    ALLEGRO_EVENT_SOURCE * events;
+
+    /* Number of files the workers are done with */
+    int done;
+    /* Last percent sent to the view */
+    int percent;
+    /* Set if a worker quit before the queue was empty */
+    bool stopped;
+
+    /* Protects done, percent and stopped */
+    ALLEGRO_MUTEX * mutex;
+};
+
+bool quitting(){
+    bool out = false;
+    al_lock_mutex(globalQuit);
+    out = doQuit;
+    al_unlock_mutex(globalQuit);
+    return out;
+}
+
+ThumbnailResults::ThumbnailResults(ALLEGRO_EVENT_SOURCE * events):
+ring(SIZE),
+woken(false),
+events(events),
+waiting(0),
+stopped(false){
+    mutex = al_create_mutex();
+    room = al_create_cond();
+}
+
+ThumbnailResults::~ThumbnailResults(){
+    al_destroy_cond(room);
+    al_destroy_mutex(mutex);
+}
+
+void ThumbnailResults::add(int index, const Thumbnail * thumbnail){
+    ThumbnailResult result;
+    result.index = index;
+    result.thumbnail = thumbnail;
+    if (!ring.push(result)){
+        al_lock_mutex(mutex);
+        waiting += 1;
+        /* Pairs with the fence in take, either take sees waiting or this push
+         * sees the cells take freed
+         */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool added = false;
+        while (!stopped){
+            if (ring.push(result)){
+                added = true;
+                break;
+            }
+            al_wait_cond(room, mutex);
+        }
+        waiting -= 1;
+        al_unlock_mutex(mutex);
+        if (!added){
+            return;
+        }
+    }
+
+    if (!woken.exchange(true)){
+        ALLEGRO_EVENT event;
+        event.user.type = VIEW_TYPE;
+        event.user.data1 = (intptr_t) this;
+        al_emit_user_event(events, &event, nullptr);
+        stats.eventSent();
+    }
+}
+
+vector<ThumbnailResult> ThumbnailResults::take(){
+    /* Anything added after this sends another event */
+    woken.exchange(false);
+
+    vector<ThumbnailResult> out;
+    ThumbnailResult result;
+    while (ring.pop(result)){
+        out.push_back(result);
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (out.size() > 0 && waiting.load() > 0){
+        al_lock_mutex(mutex);
+        al_broadcast_cond(room);
+        al_unlock_mutex(mutex);
+    }
+    return out;
+}
+
+void ThumbnailResults::stop(){
+    al_lock_mutex(mutex);
+    stopped = true;
+    al_broadcast_cond(room);
+    al_unlock_mutex(mutex);
+}
+
+/* Sends the percent of found files that have been thumbnailed. Until the scan is
+ * over the total is still growing so it never says 100 before then.
+ */
+static void updatePercent(ThumbnailJob * job){
+    int total = job->files.total();
+    bool finished = job->files.isFinished();
+
+    al_lock_mutex(job->mutex);
+    job->done += 1;
+    int now = (int)((double) job->done / (double) total * 100);
+    if (!finished && now > 99){
+        now = 99;
+    }
+    if (now > job->percent){
+        ALLEGRO_EVENT event;
+        event.user.type = PERCENT_TYPE;
+        event.user.data1 = (intptr_t) now;
+        al_emit_user_event(job->events, &event, nullptr);
+        stats.eventSent();
+        job->percent = now;
+    }
+    al_unlock_mutex(job->mutex);
+}
+
+static void * thumbnailWorker(ALLEGRO_THREAD * self, void * data){
+    ThumbnailJob * job = (ThumbnailJob*) data;
+
+    /* New bitmap flags are per thread */
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+
+    string file;
+    int index = 0;
+    while (job->files.next(file, index)){
+        if (quitting()){
+            al_lock_mutex(job->mutex);
+            job->stopped = true;
+            al_unlock_mutex(job->mutex);
+            break;
+        }
+
+        ThumbnailCache::Key key;
+        bool cacheable = job->cache.makeKey(file, key);
+
+        ALLEGRO_BITMAP * thumbnail = nullptr;
+        if (cacheable){
+            thumbnail = job->cache.get(key);
+            if (thumbnail != nullptr){
+                stats.cacheHit();
+            }
+        }
+
+        if (thumbnail == nullptr){
+            double start = al_get_time();
+            ALLEGRO_BITMAP * image = load_thumbnail_source(file);
+            double decoded = al_get_time();
+            stats.decoded((decoded - start) * 1000);
+            if (image != nullptr){
+                debug(" ..image %p\n", image);
+                thumbnail = create_thumbnail(image);
+                stats.thumbnailed((al_get_time() - decoded) * 1000);
+                al_destroy_bitmap(image);
+                if (cacheable){
+                    job->cache.put(key, thumbnail);
+                }
+            }
+        }
+
+        /* Only the arena copy is kept */
+        const Thumbnail * packed = nullptr;
+        if (thumbnail != nullptr){
+            packed = job->arena.add(thumbnail);
+            al_destroy_bitmap(thumbnail);
+        }
+
+        /* Failures are sent too so the view can drop the file */
+        job->results.add(index, packed);
+
+        updatePercent(job);
+    }
+
+    return nullptr;
+}
+
+static int thumbnailWorkers(){
+    int cpus = al_get_cpu_count();
+    if (cpus < 1){
+        return 1;
+    }
+    return cpus;
+}
+
+/* Thumbnails files from the queue on a pool of threads until the queue is
+ * finished or the program quits.
+ */
+void loadFiles(FileQueue & files, ThumbnailCache & cache, ThumbnailArena & arena, ThumbnailResults & results, ALLEGRO_EVENT_SOURCE * events){
+    ThumbnailJob job(files, cache, arena, results, events);
+
+    vector<ALLEGRO_THREAD*> workers;
+    for (int i = 0; i < thumbnailWorkers(); i++){
+        ALLEGRO_THREAD * thread = al_create_thread(thumbnailWorker, &job);
+        if (thread != nullptr){
+            al_start_thread(thread);
+            workers.push_back(thread);
+        }
+    }
+
+    for (ALLEGRO_THREAD * thread: workers){
+        al_join_thread(thread, nullptr);
+        al_destroy_thread(thread);
+    }
+
+    /* If we quit early not every file was looked at */
+    cache.save(!job.stopped && !quitting());
+
+    /* Output 100% at the end */
+    {
+        ALLEGRO_EVENT event;
+        event.user.type = PERCENT_TYPE;
+        event.user.data1 = (intptr_t) 100;
+        al_emit_user_event(events, &event, nullptr);
+        stats.eventSent();
+    }
+}
+
+/* Only files that the image addon recognizes are worth thumbnailing. Everything
+ * else is dropped by the scan's classifiers before it gets to the queue.
+ */
+bool isImage(const string & file){
+    return identifyImage(file) != "";
+}
+
+void scanImages(const string & start, bool recursive, FileQueue & files, bool (*quit)()){
+    scanFiles(start, recursive, files, isImage, quit);
+    files.finish();
+}
+
+/* Runs the directory scan on its own thread so loadImages can thumbnail files
+ * at the same time.
+ */
+static void * scanThread(ALLEGRO_THREAD * self, void * data){
+    LoadImagesStuff * stuff = (LoadImagesStuff*) data;
+    double start = al_get_time();
+    scanImages(stuff->start, stuff->recursive, *stuff->files, quitting);
+    stats.scanned(al_get_time() - start, stuff->files->total());
+    return nullptr;
+}
+
+void * loadImages(ALLEGRO_THREAD * self, void * data){
+    LoadImagesStuff * stuff = (LoadImagesStuff*) data;
+    ALLEGRO_EVENT_SOURCE * events = stuff->events;
+
+    ALLEGRO_FS_ENTRY * here = al_create_fs_entry(stuff->start.c_str());
+    if (!al_fs_entry_exists(here)){
+        std::cout << "Directory '" << stuff->start << "' does not exist" << std::endl;
+        al_destroy_fs_entry(here);
+        return nullptr;
+    }
+    al_destroy_fs_entry(here);
+    std::cout << "Searching in '" << stuff->start << "'" << std::endl;
+
+    /* The view learns about files as soon as they are found */
+    FileQueue & files = *stuff->files;
+    files.setEvents(events);
+    ALLEGRO_THREAD * scanner = al_create_thread(scanThread, stuff);
+    al_start_thread(scanner);
+
+    ThumbnailCache cache(stuff->start);
+    loadFiles(files, cache, *stuff->arena, *stuff->results, events);
+
+    al_join_thread(scanner, nullptr);
+    al_destroy_thread(scanner);
+
+    return nullptr;
+}
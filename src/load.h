@@ -0,0 +1,159 @@
+#ifndef _viewer_load_h
+#define _viewer_load_h
+
+#include <allegro5/allegro.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "events.h"
+#include "ring.h"
+
+class FileQueue;
+class ThumbnailCache;
+class ThumbnailArena;
+struct Thumbnail;
+
+/* Set doQuit (while holding globalQuit) to make the background threads stop */
+extern ALLEGRO_MUTEX * globalQuit;
+extern bool doQuit;
+
+bool quitting();
+
+/* Create thumbnails at 80x80. This is larger than the default
+ * thumbnail size that the user will see so it gives them a chance
+ * to increase the thumbnail size without messing up the images too much.
+ * Once the thumbnail size is increased beyond 80x80 (with +/-) the visible
+ * thumbnails are made again at a bigger size, see levels.h.
+ */
+const int THUMBNAIL_SIZE = 80;
+
+/* The thumbnail and the name live in a ThumbnailArena */
+struct Image{
+    Image(const Thumbnail * thumbnail, const char * name, int queued = -1):
+        thumbnail(thumbnail),
+        level(nullptr),
+        levelSize(0),
+        video(nullptr),
+        slot(-1),
+        queued(queued),
+        spill(-1),
+        filename(name){
+        }
+
+    /* nullptr while the thumbnail is evicted, see View::trimThumbnails, or
+     * while it hasn't been made yet
+     */
+    const Thumbnail * thumbnail;
+    /* A sharper thumbnail for large grid sizes and its size, see ThumbnailLevels */
+    ALLEGRO_BITMAP * level;
+    int levelSize;
+    /* Video copy of the thumbnail, a sub bitmap of a thumbnail atlas page */
+    ALLEGRO_BITMAP * video;
+    /* The atlas cell that video lives in, -1 if there is no video copy */
+    int slot;
+    /* Index of the file in the FileQueue it came from, -1 if it didn't */
+    int queued;
+    /* Where the thumbnail is in the arena's spill file, -1 if it never was evicted */
+    int64_t spill;
+    const char * filename;
+
+    /* True until the thumbnail workers get to the file */
+    bool pending() const {
+        return thumbnail == nullptr && spill < 0;
+    }
+};
+
+/* The thumbnail of the file with this index in the FileQueue, nullptr if the
+ * file couldn't be thumbnailed.
+ */
+struct ThumbnailResult{
+    int index;
+    const Thumbnail * thumbnail;
+};
+
+/* Hands thumbnails from the workers to the view. The workers push into a lock
+ * free ring and only the push that finds nobody woken yet sends a VIEW_TYPE
+ * event, with data1 pointing here. The view takes everything in the ring when
+ * it gets the event, so there is one event for however many thumbnails were
+ * made in the meantime.
+ */
+class ThumbnailResults{
+public:
+    /* Thumbnails that fit in the ring, the workers block if the view falls this far behind */
+    static const int SIZE = 4096;
+
+    ThumbnailResults(ALLEGRO_EVENT_SOURCE * events);
+    ~ThumbnailResults();
+
+    /* Called by the workers */
+    void add(int index, const Thumbnail * thumbnail);
+
+    /* Called by the thread that gets the VIEW_TYPE events */
+    std::vector<ThumbnailResult> take();
+
+    /* Called when the view won't take anything anymore, workers waiting for
+     * room drop their thumbnail
+     */
+    void stop();
+
+protected:
+    Ring<ThumbnailResult> ring;
+    /* Set while a VIEW_TYPE event is on its way */
+    std::atomic<bool> woken;
+    ALLEGRO_EVENT_SOURCE * events;
+
+    /* Workers wait on room while the ring is full, take signals it if there
+     * are any. The lock is only used when the ring was full.
+     */
+    ALLEGRO_MUTEX * mutex;
+    ALLEGRO_COND * room;
+    std::atomic<int> waiting;
+    bool stopped;
+};
+
+/* Scales an image to fit in size x size */
+ALLEGRO_BITMAP * create_thumbnail(ALLEGRO_BITMAP * image, int size = THUMBNAIL_SIZE);
+
+/* Loads the picture that a thumbnail of the given size is made from, which might
+ * be a lot smaller than the picture in the file.
+ */
+ALLEGRO_BITMAP * load_thumbnail_source(const std::string & file, int size = THUMBNAIL_SIZE);
+
+/* True if the image addon can load the file */
+bool isImage(const std::string & file);
+
+/* Adds the images in start (and below it if recursive) to files and finishes
+ * it. The viewer and the benchmark both scan through this.
+ */
+void scanImages(const std::string & start, bool recursive, FileQueue & files, bool (*quit)());
+
+/* Thumbnails files from the queue on a pool of threads until the queue is
+ * finished or the program quits. Every thumbnail is put in the arena and added
+ * to results with the file's index in the queue. The progress is sent to events
+ * as PERCENT_TYPE events.
+ */
+void loadFiles(FileQueue & files, ThumbnailCache & cache, ThumbnailArena & arena, ThumbnailResults & results, ALLEGRO_EVENT_SOURCE * events);
+
+struct LoadImagesStuff{
+    /* event source to send new images through */
+    ALLEGRO_EVENT_SOURCE * events;
+    /* true if doing a recursive search through the filesystem */
+    bool recursive;
+    /* starting directory */
+    std::string start;
+    /* where the scan puts the files it finds, the view prioritizes the
+     * files on screen through it
+     */
+    FileQueue * files;
+    /* where the thumbnails are kept */
+    ThumbnailArena * arena;
+    /* where the thumbnails are sent to the view */
+    ThumbnailResults * results;
+};
+
+/* Thread that scans the starting directory and thumbnails everything in it */
+void * loadImages(ALLEGRO_THREAD * self, void * data);
+
+#endif
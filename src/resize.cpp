@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <allegro5/allegro.h>
+#include <vector>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2
+#endif
+
+#include "resize.h"
+
+using std::vector;
+
+// #define debug(...) printf(__VA_ARGS__)
+#define debug(...)
+
+/* The source pixels (or rows) that one destination pixel covers. Every source
+ * pixel has a weight of how much of it is inside, the ones on the edges are only
+ * partly covered.
+ */
+struct Span{
+    int first;
+    int count;
+    /* Index of the first weight */
+    int weights;
+    float total;
+};
+
+static void makeSpans(int from, int to, vector<Span> & spans, vector<float> & weights){
+    double scale = (double) from / to;
+    for (int i = 0; i < to; i++){
+        double begin = i * scale;
+        double end = (i + 1) * scale;
+        int first = (int) begin;
+        int last = (int) ceil(end) - 1;
+        if (last >= from){
+            last = from - 1;
+        }
+        if (last < first){
+            last = first;
+        }
+
+        Span span;
+        span.first = first;
+        span.count = last - first + 1;
+        span.weights = weights.size();
+        span.total = 0;
+        for (int pixel = first; pixel <= last; pixel++){
+            double weight = std::min(end, pixel + 1.0) - std::max(begin, (double) pixel);
+            if (weight < 0){
+                weight = 0;
+            }
+            weights.push_back(weight);
+            span.total += weight;
+        }
+        spans.push_back(span);
+    }
+}
+
+/* sum[i] += row[i] * weight for count bytes */
+typedef void (*Accumulate)(float * sum, const unsigned char * row, int count, float weight);
+
+static void accumulateScalar(float * sum, const unsigned char * row, int count, float weight){
+    for (int i = 0; i < count; i++){
+        sum[i] += row[i] * weight;
+    }
+}
+
+#if defined(__SSE2__)
+static void accumulateSSE2(float * sum, const unsigned char * row, int count, float weight){
+    __m128 scale = _mm_set1_ps(weight);
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= count; i += 16){
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        __m128 part1 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero));
+        __m128 part2 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero));
+        __m128 part3 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero));
+        __m128 part4 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(high, zero));
+        _mm_storeu_ps(sum + i, _mm_add_ps(_mm_loadu_ps(sum + i), _mm_mul_ps(part1, scale)));
+        _mm_storeu_ps(sum + i + 4, _mm_add_ps(_mm_loadu_ps(sum + i + 4), _mm_mul_ps(part2, scale)));
+        _mm_storeu_ps(sum + i + 8, _mm_add_ps(_mm_loadu_ps(sum + i + 8), _mm_mul_ps(part3, scale)));
+        _mm_storeu_ps(sum + i + 12, _mm_add_ps(_mm_loadu_ps(sum + i + 12), _mm_mul_ps(part4, scale)));
+    }
+    accumulateScalar(sum + i, row + i, count - i, weight);
+}
+#endif
+
+#ifdef HAVE_AVX2
+/* Only called if the cpu says it has avx2, so the rest of the file can still be
+ * compiled for plain x86.
+ */
+__attribute__((target("avx2")))
+static void accumulateAVX2(float * sum, const unsigned char * row, int count, float weight){
+    __m256 scale = _mm256_set1_ps(weight);
+    int i = 0;
+    for (; i + 32 <= count; i += 32){
+        for (int part = 0; part < 32; part += 8){
+            __m256i wide = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + i + part)));
+            __m256 values = _mm256_cvtepi32_ps(wide);
+            _mm256_storeu_ps(sum + i + part, _mm256_add_ps(_mm256_loadu_ps(sum + i + part), _mm256_mul_ps(values, scale)));
+        }
+    }
+    accumulateScalar(sum + i, row + i, count - i, weight);
+}
+#endif
+
+static Accumulate pickAccumulate(){
+#ifdef HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")){
+        debug("Resize with avx2\n");
+        return accumulateAVX2;
+    }
+#endif
+#if defined(__SSE2__)
+    debug("Resize with sse2\n");
+    return accumulateSSE2;
+#else
+    return accumulateScalar;
+#endif
+}
+
+/* Adds up the columns of one accumulated row into destination pixels */
+static void reduceRow(const float * sum, const vector<Span> & columns, const vector<float> & weights,
+                      float rowTotal, unsigned char * out){
+#if defined(__SSE2__)
+    for (const Span & column: columns){
+        __m128 total = _mm_setzero_ps();
+        const float * weight = &weights[column.weights];
+        const float * pixel = sum + column.first * 4;
+        for (int i = 0; i < column.count; i++){
+            total = _mm_add_ps(total, _mm_mul_ps(_mm_loadu_ps(pixel + i * 4), _mm_set1_ps(weight[i])));
+        }
+        total = _mm_mul_ps(total, _mm_set1_ps(1.0f / (rowTotal * column.total)));
+        /* Rounds to nearest and saturates to 0-255 */
+        __m128i value = _mm_cvtps_epi32(total);
+        value = _mm_packs_epi32(value, value);
+        value = _mm_packus_epi16(value, value);
+        int32_t packed = _mm_cvtsi128_si32(value);
+        memcpy(out, &packed, 4);
+        out += 4;
+    }
+#else
+    for (const Span & column: columns){
+        float total[4] = {0, 0, 0, 0};
+        const float * weight = &weights[column.weights];
+        const float * pixel = sum + column.first * 4;
+        for (int i = 0; i < column.count; i++){
+            for (int channel = 0; channel < 4; channel++){
+                total[channel] += pixel[i * 4 + channel] * weight[i];
+            }
+        }
+        float scale = 1.0f / (rowTotal * column.total);
+        for (int channel = 0; channel < 4; channel++){
+            int value = (int)(total[channel] * scale + 0.5f);
+            out[channel] = value < 0 ? 0 : (value > 255 ? 255 : value);
+        }
+        out += 4;
+    }
+#endif
+}
+
+void shrinkPixels(const unsigned char * from, int fromPitch, int fromWidth, int fromHeight,
+                  unsigned char * to, int toPitch, int toWidth, int toHeight){
+    static Accumulate accumulate = pickAccumulate();
+
+    vector<Span> columns;
+    vector<float> columnWeights;
+    makeSpans(fromWidth, toWidth, columns, columnWeights);
+
+    vector<Span> rows;
+    vector<float> rowWeights;
+    makeSpans(fromHeight, toHeight, rows, rowWeights);
+
+    /* Rows are added up first, then the columns of the sum */
+    vector<float> sum(fromWidth * 4);
+    for (int y = 0; y < toHeight; y++){
+        const Span & row = rows[y];
+        std::fill(sum.begin(), sum.end(), 0.0f);
+        for (int i = 0; i < row.count; i++){
+            float weight = rowWeights[row.weights + i];
+            if (weight > 0){
+                accumulate(&sum[0], from + (intptr_t)(row.first + i) * fromPitch, fromWidth * 4, weight);
+            }
+        }
+
+        reduceRow(&sum[0], columns, columnWeights, row.total, to + (intptr_t) y * toPitch);
+    }
+}
+
+ALLEGRO_BITMAP * shrinkBitmap(ALLEGRO_BITMAP * image, int width, int height){
+    if (width < 1 || height < 1 || width > al_get_bitmap_width(image) || height > al_get_bitmap_height(image)){
+        return nullptr;
+    }
+
+    /* The channels are all treated the same so any 32 bit format can be read
+     * as is. Anything else is converted by allegro while it is locked.
+     */
+    int format = al_get_bitmap_format(image);
+    if (al_get_pixel_size(format) != 4){
+        format = ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE;
+    }
+
+    ALLEGRO_LOCKED_REGION * from = al_lock_bitmap(image, format, ALLEGRO_LOCK_READONLY);
+    if (from == nullptr){
+        return nullptr;
+    }
+
+    int oldFormat = al_get_new_bitmap_format();
+    int oldFlags = al_get_new_bitmap_flags();
+    al_set_new_bitmap_format(format);
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    ALLEGRO_BITMAP * out = al_create_bitmap(width, height);
+    al_set_new_bitmap_format(oldFormat);
+    al_set_new_bitmap_flags(oldFlags);
+    if (out == nullptr){
+        al_unlock_bitmap(image);
+        return nullptr;
+    }
+
+    ALLEGRO_LOCKED_REGION * to = al_lock_bitmap(out, format, ALLEGRO_LOCK_WRITEONLY);
+    if (to == nullptr){
+        al_unlock_bitmap(image);
+        al_destroy_bitmap(out);
+        return nullptr;
+    }
+
+    shrinkPixels((const unsigned char *) from->data, from->pitch, al_get_bitmap_width(image), al_get_bitmap_height(image),
+                 (unsigned char *) to->data, to->pitch, width, height);
+
+    al_unlock_bitmap(out);
+    al_unlock_bitmap(image);
+    return out;
+}
@@ -0,0 +1,21 @@
+#ifndef _viewer_resize_h
+#define _viewer_resize_h
+
+#include <allegro5/allegro.h>
+
+/* Shrinks 32 bit pixels (any channel order, every channel is treated the same)
+ * by averaging the area of the source that each destination pixel covers. Unlike
+ * point sampling every source pixel contributes, so big photos don't alias.
+ *
+ * The inner loops use AVX2 or SSE2 when the cpu has them.
+ */
+void shrinkPixels(const unsigned char * from, int fromPitch, int fromWidth, int fromHeight,
+                  unsigned char * to, int toPitch, int toWidth, int toHeight);
+
+/* Returns a new memory bitmap of the given size made with shrinkPixels, or
+ * nullptr if the bitmaps couldn't be locked. The size must not be larger than
+ * the image.
+ */
+ALLEGRO_BITMAP * shrinkBitmap(ALLEGRO_BITMAP * image, int width, int height);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef _viewer_ring_h
+#define _viewer_ring_h
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A fixed size queue that any number of threads push to and one thread pops
+ * from, without locks.
+ *
+ * Every cell has a sequence number. A cell is free for the push at position p
+ * when its sequence is p and full for the pop at p when it is p + 1, so a push
+ * only has to win the tail counter and the pop never touches it. The size must
+ * be a power of two.
+ */
+template <class T>
+class Ring{
+public:
+    Ring(size_t size):
+    cells(size),
+    mask(size - 1),
+    head(0),
+    tail(0){
+        for (size_t i = 0; i < size; i++){
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /* Returns false if the ring is full */
+    bool push(const T & value){
+        size_t position = tail.load(std::memory_order_relaxed);
+        while (true){
+            Cell & cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+            if (difference == 0){
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)){
+                    cell.value = value;
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+                /* Another thread took the cell, position is the new tail */
+            } else if (difference < 0){
+                /* The pop hasn't gotten to the value from the last lap */
+                return false;
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /* Only one thread can pop. Returns false if the ring is empty. */
+    bool pop(T & value){
+        Cell & cell = cells[head & mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if ((intptr_t) sequence - (intptr_t) (head + 1) < 0){
+            return false;
+        }
+        value = cell.value;
+        /* Free for the push one lap later */
+        cell.sequence.store(head + mask + 1, std::memory_order_release);
+        head += 1;
+        return true;
+    }
+
+private:
+    struct Cell{
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::vector<Cell> cells;
+    const size_t mask;
+    /* Only used by the pop */
+    size_t head;
+    std::atomic<size_t> tail;
+};
+
+#endif
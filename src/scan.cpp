@@ -0,0 +1,528 @@
+#include "scan.h"
+#include "events.h"
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <set>
+#include <utility>
+
+using std::string;
+using std::vector;
+
+// #define debug(...) printf(__VA_ARGS__)
+#define debug(...)
+
+FileQueue::FileQueue():
+events(nullptr),
+cursor(0),
+finished(false){
+    mutex = al_create_mutex();
+    ready = al_create_cond();
+}
+
+FileQueue::~FileQueue(){
+    al_destroy_cond(ready);
+    al_destroy_mutex(mutex);
+}
+
+void FileQueue::setEvents(ALLEGRO_EVENT_SOURCE * events){
+    this->events = events;
+}
+
+void FileQueue::add(const string & file){
+    add(vector<string>(1, file));
+}
+
+void FileQueue::add(const vector<string> & more){
+    if (more.size() == 0){
+        return;
+    }
+    FoundFiles * found = nullptr;
+    if (events != nullptr){
+        found = new FoundFiles();
+        found->names = more;
+    }
+
+    al_lock_mutex(mutex);
+    int first = files.size();
+    files.insert(files.end(), more.begin(), more.end());
+    taken.resize(files.size(), false);
+
+    /* Sent while holding the lock so the files are always announced before a
+     * thumbnail of one of them can be sent, and in the order of their indexes.
+     */
+    if (found != nullptr){
+        found->first = first;
+        ALLEGRO_EVENT event;
+        event.user.type = FOUND_TYPE;
+        event.user.data1 = (intptr_t) found;
+        al_emit_user_event(events, &event, nullptr);
+        stats.eventSent();
+    }
+    al_broadcast_cond(ready);
+    al_unlock_mutex(mutex);
+}
+
+void FileQueue::finish(){
+    al_lock_mutex(mutex);
+    finished = true;
+    al_broadcast_cond(ready);
+    al_unlock_mutex(mutex);
+}
+
+bool FileQueue::next(string & file, int & index){
+    bool out = false;
+    al_lock_mutex(mutex);
+    while (true){
+        while (urgent.size() > 0 && taken[urgent.front()]){
+            urgent.pop_front();
+        }
+        while (cursor < files.size() && taken[cursor]){
+            cursor += 1;
+        }
+        if (urgent.size() > 0 || cursor < files.size() || finished){
+            break;
+        }
+        al_wait_cond(ready, mutex);
+    }
+
+    if (urgent.size() > 0){
+        index = urgent.front();
+        urgent.pop_front();
+        out = true;
+    } else if (cursor < files.size()){
+        index = cursor;
+        cursor += 1;
+        out = true;
+    }
+
+    if (out){
+        taken[index] = true;
+        /* Nobody needs the name in here anymore */
+        files[index].swap(file);
+        string().swap(files[index]);
+    }
+    al_unlock_mutex(mutex);
+    return out;
+}
+
+void FileQueue::prioritize(const vector<int> & indexes){
+    al_lock_mutex(mutex);
+    urgent.clear();
+    for (int index: indexes){
+        if (index >= 0 && index < (int) files.size() && !taken[index]){
+            urgent.push_back(index);
+        }
+    }
+    al_broadcast_cond(ready);
+    al_unlock_mutex(mutex);
+}
+
+int FileQueue::total() const {
+    int out = 0;
+    al_lock_mutex(mutex);
+    out = files.size();
+    al_unlock_mutex(mutex);
+    return out;
+}
+
+bool FileQueue::isFinished() const {
+    bool out = false;
+    al_lock_mutex(mutex);
+    out = finished;
+    al_unlock_mutex(mutex);
+    return out;
+}
+
+/* Directories waiting to be visited by one walker. The owner takes from the
+ * back so it goes depth first, thieves take from the front.
+ */
+struct WalkQueue{
+    WalkQueue(){
+        mutex = al_create_mutex();
+    }
+
+    ~WalkQueue(){
+        al_destroy_mutex(mutex);
+    }
+
+    ALLEGRO_MUTEX * mutex;
+    std::deque<string> directories;
+};
+
+/* State shared by all the walkers */
+struct Walk{
+    Walk(bool recursive, FileQueue & files, bool (*accept)(const string & file), bool (*quit)()):
+    recursive(recursive),
+    files(files),
+    accept(accept),
+    quit(quit),
+    pending(0),
+    queued(0),
+    walked(false){
+        mutex = al_create_mutex();
+        wake = al_create_cond();
+        visitedMutex = al_create_mutex();
+        classifyMutex = al_create_mutex();
+        classifyWake = al_create_cond();
+    }
+
+    ~Walk(){
+        for (WalkQueue * queue: queues){
+            delete queue;
+        }
+        al_destroy_cond(classifyWake);
+        al_destroy_mutex(classifyMutex);
+        al_destroy_mutex(visitedMutex);
+        al_destroy_cond(wake);
+        al_destroy_mutex(mutex);
+    }
+
+    bool recursive;
+    FileQueue & files;
+    bool (*accept)(const string & file);
+    bool (*quit)();
+
+    vector<WalkQueue*> queues;
+
+    /* Directories queued or being walked, the scan is over when this is 0 */
+    int pending;
+    /* Directories sitting in a queue */
+    int queued;
+    /* Protects pending and queued */
+    ALLEGRO_MUTEX * mutex;
+    /* Signalled when a directory is queued or pending reaches 0 */
+    ALLEGRO_COND * wake;
+
+    /* Device and inode of every directory that was queued */
+    std::set<std::pair<dev_t, ino_t> > visited;
+    ALLEGRO_MUTEX * visitedMutex;
+
+    /* Regular files the walkers found that accept hasn't looked at yet */
+    std::deque<vector<string> > unclassified;
+    /* Set once every directory was walked */
+    bool walked;
+    /* Protects unclassified and walked */
+    ALLEGRO_MUTEX * classifyMutex;
+    /* Signalled when files are found or the walk is over */
+    ALLEGRO_COND * classifyWake;
+};
+
+struct Walker{
+    Walk * walk;
+    int index;
+};
+
+/* Returns true if the directory hasn't been seen before */
+static bool firstVisit(Walk & walk, const struct stat & info){
+    al_lock_mutex(walk.visitedMutex);
+    bool out = walk.visited.insert(std::make_pair(info.st_dev, info.st_ino)).second;
+    al_unlock_mutex(walk.visitedMutex);
+    return out;
+}
+
+static void push(Walk & walk, int index, const string & directory){
+    al_lock_mutex(walk.mutex);
+    walk.pending += 1;
+    walk.queued += 1;
+    al_unlock_mutex(walk.mutex);
+
+    WalkQueue * queue = walk.queues[index];
+    al_lock_mutex(queue->mutex);
+    queue->directories.push_back(directory);
+    al_unlock_mutex(queue->mutex);
+
+    al_lock_mutex(walk.mutex);
+    al_broadcast_cond(walk.wake);
+    al_unlock_mutex(walk.mutex);
+}
+
+/* Takes from our own queue first and then from everyone else's */
+static bool pop(Walk & walk, int index, string & directory){
+    int count = walk.queues.size();
+    for (int i = 0; i < count; i++){
+        WalkQueue * queue = walk.queues[(index + i) % count];
+        bool found = false;
+        al_lock_mutex(queue->mutex);
+        if (queue->directories.size() > 0){
+            if (i == 0){
+                directory = queue->directories.back();
+                queue->directories.pop_back();
+            } else {
+                directory = queue->directories.front();
+                queue->directories.pop_front();
+            }
+            found = true;
+        }
+        al_unlock_mutex(queue->mutex);
+
+        if (found){
+            al_lock_mutex(walk.mutex);
+            walk.queued -= 1;
+            al_unlock_mutex(walk.mutex);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void done(Walk & walk){
+    al_lock_mutex(walk.mutex);
+    walk.pending -= 1;
+    if (walk.pending == 0){
+        al_broadcast_cond(walk.wake);
+    }
+    al_unlock_mutex(walk.mutex);
+}
+
+/* Most files a directory collects before they are classified */
+static const size_t FLUSH_FILES = 256;
+/* Longest a found file waits before it is classified */
+static const double FLUSH_SECONDS = 0.005;
+
+/* Hands files to the classifiers */
+static void classify(Walk & walk, vector<string> & files){
+    if (files.size() == 0){
+        return;
+    }
+    al_lock_mutex(walk.classifyMutex);
+    walk.unclassified.push_back(vector<string>());
+    walk.unclassified.back().swap(files);
+    al_signal_cond(walk.classifyWake);
+    al_unlock_mutex(walk.classifyMutex);
+}
+
+static void walkFinished(Walk & walk){
+    al_lock_mutex(walk.classifyMutex);
+    walk.walked = true;
+    al_broadcast_cond(walk.classifyWake);
+    al_unlock_mutex(walk.classifyMutex);
+}
+
+/* Runs accept on the files the walkers found, which usually means opening
+ * them, and adds the ones it takes to the queue. This runs on its own pool
+ * so a single directory isn't read one file open at a time, and so only
+ * accepted files are ever announced to the queue.
+ */
+static void * classifier(ALLEGRO_THREAD * self, void * data){
+    Walk & walk = *(Walk*) data;
+
+    while (true){
+        vector<string> files;
+        al_lock_mutex(walk.classifyMutex);
+        while (walk.unclassified.size() == 0 && !walk.walked){
+            al_wait_cond(walk.classifyWake, walk.classifyMutex);
+        }
+        if (walk.unclassified.size() > 0){
+            files.swap(walk.unclassified.front());
+            walk.unclassified.pop_front();
+        }
+        al_unlock_mutex(walk.classifyMutex);
+
+        if (files.size() == 0){
+            break;
+        }
+
+        vector<string> accepted;
+        for (const string & file: files){
+            if (walk.quit()){
+                break;
+            }
+            if (walk.accept(file)){
+                accepted.push_back(file);
+            }
+        }
+        walk.files.add(accepted);
+    }
+
+    return nullptr;
+}
+
+static void walkDirectory(Walk & walk, int index, const string & path){
+    DIR * directory = opendir(path.c_str());
+    if (directory == nullptr){
+        return;
+    }
+
+    string prefix = path;
+    if (prefix.size() == 0 || prefix[prefix.size() - 1] != '/'){
+        prefix += "/";
+    }
+
+    /* Files go to the classifiers in chunks to keep the locks quiet, but often
+     * enough that a big flat directory shows up while it is still being read
+     */
+    vector<string> found;
+    double lastFlush = al_get_time();
+    struct dirent * entry = readdir(directory);
+    while (entry != nullptr){
+        if (walk.quit()){
+            break;
+        }
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0){
+            entry = readdir(directory);
+            continue;
+        }
+
+        string name = prefix + entry->d_name;
+        debug("Entry %s\n", name.c_str());
+
+        bool isDirectory = false;
+        bool isFile = false;
+        bool needStat = true;
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (entry->d_type == DT_REG){
+            isFile = true;
+            needStat = false;
+        } else if (entry->d_type == DT_DIR){
+            isDirectory = true;
+            /* Only need the device and inode if we are going inside */
+            needStat = walk.recursive;
+        } else if (entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN){
+            /* Devices, fifos and sockets */
+            needStat = false;
+        }
+#endif
+
+        struct stat info;
+        if (needStat){
+            /* stat follows symlinks */
+            if (stat(name.c_str(), &info) == 0){
+                isDirectory = S_ISDIR(info.st_mode);
+                isFile = S_ISREG(info.st_mode);
+            } else {
+                isDirectory = false;
+                isFile = false;
+            }
+        }
+
+        if (isDirectory && walk.recursive){
+            if (firstVisit(walk, info)){
+                push(walk, index, name);
+            } else {
+                debug("Already visited %s\n", name.c_str());
+            }
+        } else if (isFile){
+            found.push_back(name);
+            if (found.size() >= FLUSH_FILES || al_get_time() - lastFlush >= FLUSH_SECONDS){
+                classify(walk, found);
+                lastFlush = al_get_time();
+            }
+        }
+
+        entry = readdir(directory);
+    }
+    closedir(directory);
+
+    classify(walk, found);
+}
+
+static void * walker(ALLEGRO_THREAD * self, void * data){
+    Walker * walker = (Walker*) data;
+    Walk & walk = *walker->walk;
+
+    while (true){
+        string directory;
+        if (pop(walk, walker->index, directory)){
+            walkDirectory(walk, walker->index, directory);
+            done(walk);
+            continue;
+        }
+
+        al_lock_mutex(walk.mutex);
+        /* Someone else might be about to push more directories */
+        while (walk.pending > 0 && walk.queued == 0){
+            al_wait_cond(walk.wake, walk.mutex);
+        }
+        bool finished = walk.pending == 0;
+        al_unlock_mutex(walk.mutex);
+
+        if (finished){
+            break;
+        }
+    }
+
+    return nullptr;
+}
+
+/* Scanning is mostly waiting on the disk so use a few threads even on small machines */
+static int walkers(){
+    int cpus = al_get_cpu_count();
+    if (cpus < 4){
+        return 4;
+    }
+    return cpus;
+}
+
+/* Starts the classifiers, they run until walkFinished */
+static vector<ALLEGRO_THREAD*> startClassifiers(Walk & walk){
+    vector<ALLEGRO_THREAD*> threads;
+    for (int i = 0; i < walkers(); i++){
+        ALLEGRO_THREAD * thread = al_create_thread(classifier, &walk);
+        if (thread != nullptr){
+            al_start_thread(thread);
+            threads.push_back(thread);
+        }
+    }
+    return threads;
+}
+
+static void joinThreads(const vector<ALLEGRO_THREAD*> & threads){
+    for (ALLEGRO_THREAD * thread: threads){
+        al_join_thread(thread, nullptr);
+        al_destroy_thread(thread);
+    }
+}
+
+static void walkTree(Walk & walk, const string & start){
+    int count = walkers();
+    vector<Walker> state(count);
+    for (int i = 0; i < count; i++){
+        walk.queues.push_back(new WalkQueue());
+        state[i].walk = &walk;
+        state[i].index = i;
+    }
+
+    push(walk, 0, start);
+
+    vector<ALLEGRO_THREAD*> threads;
+    for (int i = 0; i < count; i++){
+        ALLEGRO_THREAD * thread = al_create_thread(walker, &state[i]);
+        if (thread != nullptr){
+            al_start_thread(thread);
+            threads.push_back(thread);
+        }
+    }
+
+    joinThreads(threads);
+}
+
+void scanFiles(const string & start, bool recursive, FileQueue & files, bool (*accept)(const string & file), bool (*quit)()){
+    Walk walk(recursive, files, accept, quit);
+
+    struct stat info;
+    if (stat(start.c_str(), &info) != 0){
+        return;
+    }
+    firstVisit(walk, info);
+
+    vector<ALLEGRO_THREAD*> classifiers = startClassifiers(walk);
+
+    if (recursive){
+        walkTree(walk, start);
+    } else {
+        walk.queues.push_back(new WalkQueue());
+        walkDirectory(walk, 0, start);
+    }
+
+    walkFinished(walk);
+    if (classifiers.size() == 0){
+        /* No threads, classify everything here */
+        classifier(nullptr, &walk);
+    }
+    joinThreads(classifiers);
+}
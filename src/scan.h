@@ -0,0 +1,86 @@
+#ifndef _viewer_scan_h
+#define _viewer_scan_h
+
+#include <allegro5/allegro.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+/* Sent with FOUND_TYPE when files are added to a queue that has an event source.
+ * The files have the indexes first, first + 1 and so on.
+ */
+struct FoundFiles{
+    int first;
+    std::vector<std::string> names;
+};
+
+/* Files found by the directory scan that are waiting for a thumbnail. The scan
+ * adds files as it finds them and the thumbnail workers take them off, so the
+ * first thumbnails show up long before the scan is done.
+ *
+ * Every file gets an index in the order it was added. Files are handed out in
+ * that order except for the ones that were prioritized, which go first.
+ */
+class FileQueue{
+public:
+    FileQueue();
+    ~FileQueue();
+
+    /* New files are sent to events as FOUND_TYPE events */
+    void setEvents(ALLEGRO_EVENT_SOURCE * events);
+
+    void add(const std::string & file);
+    void add(const std::vector<std::string> & files);
+
+    /* Called by the scan when there are no more files */
+    void finish();
+
+    /* Waits for the next file. Returns false once the scan is finished and
+     * every file has been handed out.
+     */
+    bool next(std::string & file, int & index);
+
+    /* Hands out these files (by index) before any others, in this order. Replaces
+     * whatever was prioritized before. Files that were already handed out are
+     * skipped.
+     */
+    void prioritize(const std::vector<int> & indexes);
+
+    /* Number of files the scan has found so far */
+    int total() const;
+
+    bool isFinished() const;
+
+protected:
+    ALLEGRO_MUTEX * mutex;
+    /* Signalled when a file is added or the scan finishes */
+    ALLEGRO_COND * ready;
+    ALLEGRO_EVENT_SOURCE * events;
+    /* Every file added, emptied once its handed out */
+    std::vector<std::string> files;
+    std::vector<bool> taken;
+    /* The next file in the normal order */
+    size_t cursor;
+    std::deque<int> urgent;
+    bool finished;
+};
+
+/* Finds the files in a directory, and in all the directories below it if recursive
+ * is true, and adds the ones that accept returns true for to the queue. The queue is
+ * not finished by this.
+ *
+ * The walkers only sort out regular files. accept is called on them by a separate
+ * pool of classifier threads in chunks as the walkers find them, so files that
+ * accept turns down never reach the queue.
+ *
+ * Directories are walked by a pool of threads that each keep their own list of
+ * directories to visit and steal from each other when they run out. The file type
+ * comes from readdir where the filesystem reports it so only directories and
+ * symlinks have to be stat'ed. Every directory is visited once by its device and
+ * inode, so symlink and bind mount loops don't make the scan run forever.
+ *
+ * quit is polled while scanning, the scan stops early if it returns true.
+ */
+void scanFiles(const std::string & start, bool recursive, FileQueue & files, bool (*accept)(const std::string & file), bool (*quit)());
+
+#endif
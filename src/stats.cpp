@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <allegro5/allegro.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+
+#include "stats.h"
+#include "events.h"
+
+using std::vector;
+using std::string;
+
+// #define debug(...) printf(__VA_ARGS__)
+#define debug(...)
+
+Stats stats;
+
+void Timing::add(double ms){
+    count += 1;
+    total += ms;
+    last = ms;
+    if (ms > max){
+        max = ms;
+    }
+}
+
+double Timing::mean() const {
+    if (count == 0){
+        return 0;
+    }
+    return total / count;
+}
+
+Stats::Stats():
+mutex(nullptr),
+start(0),
+scanSeconds(-1),
+scanFiles(0),
+firstThumbnail(-1),
+cacheHits(0),
+atlasThumbnails(0),
+taskDepth(0),
+taskDepthMax(0),
+eventsSent(0),
+eventsReceived(0),
+eventDepthMax(0),
+rateStart(0),
+rateFrames(0),
+redrawRate(0){
+}
+
+Stats::~Stats(){
+    if (mutex != nullptr){
+        al_destroy_mutex(mutex);
+    }
+}
+
+void Stats::begin(){
+    if (mutex == nullptr){
+        mutex = al_create_mutex();
+    }
+    start = al_get_time();
+    rateStart = start;
+}
+
+double Stats::elapsed() const {
+    return al_get_time() - start;
+}
+
+void Stats::scanned(double seconds, int files){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    scanSeconds = seconds;
+    scanFiles = files;
+    al_unlock_mutex(mutex);
+}
+
+void Stats::decoded(double ms){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    decode.add(ms);
+    al_unlock_mutex(mutex);
+}
+
+void Stats::thumbnailed(double ms){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    thumbnail.add(ms);
+    al_unlock_mutex(mutex);
+}
+
+void Stats::cacheHit(){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    cacheHits += 1;
+    al_unlock_mutex(mutex);
+}
+
+void Stats::shownThumbnail(){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    if (firstThumbnail < 0){
+        firstThumbnail = elapsed();
+    }
+    al_unlock_mutex(mutex);
+}
+
+void Stats::loaded(double ms){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    load.add(ms);
+    al_unlock_mutex(mutex);
+}
+
+void Stats::previewed(double ms){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    preview.add(ms);
+    al_unlock_mutex(mutex);
+}
+
+void Stats::loadCancelled(double ms){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    cancelled.add(ms);
+    al_unlock_mutex(mutex);
+}
+
+void Stats::tiled(double ms){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    tiles.add(ms);
+    al_unlock_mutex(mutex);
+}
+
+void Stats::uploaded(double ms){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    upload.add(ms);
+    al_unlock_mutex(mutex);
+}
+
+void Stats::atlasUploaded(double ms, int thumbnails){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    atlas.add(ms);
+    atlasThumbnails += thumbnails;
+    al_unlock_mutex(mutex);
+}
+
+void Stats::tasks(int depth){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    taskDepth = depth;
+    if (depth > taskDepthMax){
+        taskDepthMax = depth;
+    }
+    al_unlock_mutex(mutex);
+}
+
+void Stats::eventSent(){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    eventsSent += 1;
+    if (eventsSent - eventsReceived > eventDepthMax){
+        eventDepthMax = eventsSent - eventsReceived;
+    }
+    al_unlock_mutex(mutex);
+}
+
+void Stats::eventReceived(const ALLEGRO_EVENT & event){
+    if (mutex == nullptr){
+        return;
+    }
+    if (event.type != VIEW_TYPE && event.type != PERCENT_TYPE && event.type != LOAD_TYPE && event.type != LEVEL_TYPE && event.type != FOUND_TYPE && event.type != TILE_TYPE){
+        return;
+    }
+    al_lock_mutex(mutex);
+    eventsReceived += 1;
+    al_unlock_mutex(mutex);
+}
+
+void Stats::frame(double ms){
+    if (mutex == nullptr){
+        return;
+    }
+    al_lock_mutex(mutex);
+    frames.add(ms);
+    rateFrames += 1;
+    double now = al_get_time();
+    if (now - rateStart >= 1){
+        redrawRate = rateFrames / (now - rateStart);
+        rateFrames = 0;
+        rateStart = now;
+    }
+    al_unlock_mutex(mutex);
+}
+
+static string describeTiming(const char * name, const Timing & timing){
+    char line[128];
+    snprintf(line, sizeof(line), "%s: %.2fms avg, %.2fms max, %d", name, timing.mean(), timing.max, timing.count);
+    return line;
+}
+
+vector<string> Stats::describe(){
+    vector<string> out;
+    if (mutex == nullptr){
+        return out;
+    }
+
+    char line[128];
+    al_lock_mutex(mutex);
+    if (scanSeconds < 0){
+        snprintf(line, sizeof(line), "scan: running");
+    } else {
+        snprintf(line, sizeof(line), "scan: %.2fs, %d files", scanSeconds, scanFiles);
+    }
+    out.push_back(line);
+    if (firstThumbnail < 0){
+        snprintf(line, sizeof(line), "first thumbnail: waiting");
+    } else {
+        snprintf(line, sizeof(line), "first thumbnail: %.3fs", firstThumbnail);
+    }
+    out.push_back(line);
+    out.push_back(describeTiming("decode", decode));
+    out.push_back(describeTiming("thumbnail", thumbnail));
+    snprintf(line, sizeof(line), "cache hits: %d", cacheHits);
+    out.push_back(line);
+    out.push_back(describeTiming("load", load));
+    out.push_back(describeTiming("preview", preview));
+    out.push_back(describeTiming("cancelled", cancelled));
+    out.push_back(describeTiming("tiles", tiles));
+    out.push_back(describeTiming("upload", upload));
+    out.push_back(describeTiming("atlas", atlas));
+    snprintf(line, sizeof(line), "tasks: %d, %d max", taskDepth, taskDepthMax);
+    out.push_back(line);
+    snprintf(line, sizeof(line), "events: %d, %d max", eventsSent - eventsReceived, eventDepthMax);
+    out.push_back(line);
+    out.push_back(describeTiming("frame", frames));
+    snprintf(line, sizeof(line), "redraws: %.1f/s", redrawRate);
+    out.push_back(line);
+    al_unlock_mutex(mutex);
+
+    return out;
+}
+
+static string timingJson(const Timing & timing){
+    std::ostringstream out;
+    out << "{\"count\": " << timing.count
+        << ", \"mean_ms\": " << timing.mean()
+        << ", \"max_ms\": " << timing.max
+        << ", \"total_ms\": " << timing.total << "}";
+    return out.str();
+}
+
+bool Stats::save(const string & path){
+    if (mutex == nullptr){
+        return false;
+    }
+
+    std::ofstream out(path.c_str());
+    if (!out.good()){
+        return false;
+    }
+
+    al_lock_mutex(mutex);
+    out << "{\n"
+        << "  \"seconds\": " << elapsed() << ",\n"
+        << "  \"scan\": {\"seconds\": " << scanSeconds << ", \"files\": " << scanFiles << "},\n"
+        << "  \"first_thumbnail_seconds\": " << firstThumbnail << ",\n"
+        << "  \"decode\": " << timingJson(decode) << ",\n"
+        << "  \"thumbnail\": " << timingJson(thumbnail) << ",\n"
+        << "  \"cache_hits\": " << cacheHits << ",\n"
+        << "  \"load\": " << timingJson(load) << ",\n"
+        << "  \"preview\": " << timingJson(preview) << ",\n"
+        << "  \"cancelled_load\": " << timingJson(cancelled) << ",\n"
+        << "  \"tiles\": " << timingJson(tiles) << ",\n"
+        << "  \"upload\": " << timingJson(upload) << ",\n"
+        << "  \"atlas\": " << timingJson(atlas) << ",\n"
+        << "  \"atlas_thumbnails\": " << atlasThumbnails << ",\n"
+        << "  \"task_depth_max\": " << taskDepthMax << ",\n"
+        << "  \"event_depth_max\": " << eventDepthMax << ",\n"
+        << "  \"frame\": " << timingJson(frames) << ",\n"
+        << "  \"redraws_per_second\": " << redrawRate << "\n"
+        << "}\n";
+    al_unlock_mutex(mutex);
+
+    return out.good();
+}
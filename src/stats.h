@@ -0,0 +1,121 @@
+#ifndef _viewer_stats_h
+#define _viewer_stats_h
+
+#include <allegro5/allegro.h>
+#include <string>
+#include <vector>
+
+/* Running totals for one stage, in milliseconds */
+struct Timing{
+    Timing():
+    count(0),
+    total(0),
+    max(0),
+    last(0){
+    }
+
+    void add(double ms);
+    double mean() const;
+
+    int count;
+    double total;
+    double max;
+    double last;
+};
+
+/* Counters and timers for every stage of the viewer so its possible to tell
+ * whether the scan, decoding, thumbnailing, uploads or drawing is the slow part.
+ *
+ * Nothing is recorded until begin is called, so programs that don't care about
+ * statistics (like the bench) pay for one pointer check. Every method can be
+ * called from any thread. Use the global 'stats' object.
+ */
+class Stats{
+public:
+    Stats();
+    ~Stats();
+
+    /* Starts recording. Times like the first thumbnail are relative to this */
+    void begin();
+
+    /* Seconds since begin */
+    double elapsed() const;
+
+    /* The directory scan finished */
+    void scanned(double seconds, int files);
+
+    /* Decoding a file for its thumbnail (load_thumbnail_source) */
+    void decoded(double ms);
+    /* Scaling a decoded file down to a thumbnail (create_thumbnail) */
+    void thumbnailed(double ms);
+    /* A thumbnail came out of the thumbnail cache */
+    void cacheHit();
+    /* The view got a thumbnail, only the first one is remembered */
+    void shownThumbnail();
+
+    /* Loading a full size image in an ImageManager worker */
+    void loaded(double ms);
+    /* From starting a full size load until its reduced size preview was ready */
+    void previewed(double ms);
+    /* A full size load that was cancelled, how long it ran before it stopped */
+    void loadCancelled(double ms);
+    /* Cutting a huge picture into tiles, see TiledImage */
+    void tiled(double ms);
+    /* Converting a full size image to a video bitmap in ImageManager::get */
+    void uploaded(double ms);
+    /* Copying new thumbnails into the atlas */
+    void atlasUploaded(double ms, int thumbnails);
+
+    /* Number of tasks waiting in the ImageManager's task list */
+    void tasks(int depth);
+
+    /* A pipeline event was emitted / taken off the event queue. The difference
+     * is how many are waiting in the queue.
+     */
+    void eventSent();
+    void eventReceived(const ALLEGRO_EVENT & event);
+
+    /* One redraw of the screen */
+    void frame(double ms);
+
+    /* Human readable summary, one line per stage */
+    std::vector<std::string> describe();
+
+    /* Writes everything as JSON. Returns false if the file can't be written */
+    bool save(const std::string & path);
+
+private:
+    ALLEGRO_MUTEX * mutex;
+    double start;
+
+    double scanSeconds;
+    int scanFiles;
+    double firstThumbnail;
+    int cacheHits;
+
+    Timing decode;
+    Timing thumbnail;
+    Timing load;
+    Timing preview;
+    Timing cancelled;
+    Timing tiles;
+    Timing upload;
+    Timing atlas;
+    int atlasThumbnails;
+    Timing frames;
+
+    int taskDepth;
+    int taskDepthMax;
+    int eventsSent;
+    int eventsReceived;
+    int eventDepthMax;
+
+    /* Redraws in the current one second window and the rate of the last one */
+    double rateStart;
+    int rateFrames;
+    double redrawRate;
+};
+
+extern Stats stats;
+
+#endif
@@ -0,0 +1,609 @@
+#include "tiles.h"
+#include "events.h"
+#include "resize.h"
+#include "stats.h"
+#include "load.h"
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <algorithm>
+
+using std::string;
+using std::vector;
+
+// #define debug(...) printf(__VA_ARGS__)
+#define debug(...)
+
+bool isHuge(int width, int height){
+    return width > HUGE_SIDE || height > HUGE_SIDE || (int64_t) width * height > HUGE_PIXELS;
+}
+
+/* std::min takes it by reference */
+const int TiledImage::TILE_SIZE;
+
+/* Only touched by the drawing thread */
+static int nextId = 0;
+
+/* A complete tile file ends with the offset of every tile, level by level and
+ * row by row, and then this. All numbers in host byte order.
+ */
+static const char TILES_MAGIC[8] = {'V', 'T', 'I', 'L', 'E', 'S', '0', '1'};
+
+struct TilesFooter{
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    int32_t tileSize;
+    int32_t levels;
+    /* Where the offsets start */
+    int64_t index;
+};
+
+/* Where the tiles of this version of the file are kept, empty if there is no
+ * cache directory or the file can't be stat'ed
+ */
+static string tilesPath(const string & file){
+    string where = cacheDirectory();
+    char * real = realpath(file.c_str(), nullptr);
+    struct stat info;
+    if (where == "" || real == nullptr || stat(real, &info) != 0){
+        free(real);
+        return "";
+    }
+
+    char key[64];
+    snprintf(key, sizeof(key), "\n%lld\n%lld", (long long) info.st_size,
+             (long long) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec);
+    string name = string(real) + key;
+    free(real);
+
+    char hash[32];
+    snprintf(hash, sizeof(hash), "%016llx.tiles", (unsigned long long) hashString(name));
+    return where + "/tiles/" + hash;
+}
+
+/* Removes the least recently used tile files, except keep, until they all fit
+ * in CACHE_BYTES
+ */
+static void trimTiles(const string & directory, const string & keep){
+    DIR * tiles = opendir(directory.c_str());
+    if (tiles == nullptr){
+        return;
+    }
+
+    vector<std::pair<time_t, string> > files;
+    int64_t total = 0;
+    struct dirent * entry = readdir(tiles);
+    while (entry != nullptr){
+        string path = directory + "/" + entry->d_name;
+        struct stat info;
+        if (entry->d_name[0] != '.' && stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode)){
+            total += info.st_size;
+            if (path != keep){
+                files.push_back(std::make_pair(info.st_mtime, path));
+            }
+        }
+        entry = readdir(tiles);
+    }
+    closedir(tiles);
+
+    std::sort(files.begin(), files.end());
+    for (const std::pair<time_t, string> & file: files){
+        if (total <= TiledImage::CACHE_BYTES){
+            break;
+        }
+        struct stat info;
+        if (stat(file.second.c_str(), &info) == 0 && unlink(file.second.c_str()) == 0){
+            total -= info.st_size;
+        }
+    }
+}
+
+TiledImage::TiledImage(const string & file, int width, int height, ALLEGRO_EVENT_SOURCE * events):
+file(file),
+width(width),
+height(height),
+id(nextId++),
+events(events),
+builder(nullptr),
+reader(nullptr),
+stopped(false),
+tiles(nullptr),
+tilesSize(0),
+writeFailed(false),
+frame(0){
+    mutex = al_create_mutex();
+    ready = al_create_cond();
+
+    for (int level = 0; level < LEVELS; level++){
+        offsets[level].resize(columns(level) * rows(level), -1);
+        stripLines[level] = 0;
+        stripRow[level] = 0;
+    }
+
+    openTiles();
+    if (tiles == nullptr){
+        /* Everything is drawn from the fallback */
+        return;
+    }
+
+    if (buildPath != "" || cachePath == ""){
+        builder = al_create_thread(runBuild, this);
+        if (builder != nullptr){
+            al_start_thread(builder);
+        }
+    }
+    reader = al_create_thread(runRead, this);
+    if (reader != nullptr){
+        al_start_thread(reader);
+    }
+}
+
+void TiledImage::openTiles(){
+    cachePath = tilesPath(file);
+    if (cachePath == ""){
+        tiles = tmpfile();
+        return;
+    }
+
+    tiles = fopen(cachePath.c_str(), "rb");
+    if (tiles != nullptr){
+        if (readIndex()){
+            /* Used last, trimmed last */
+            utimes(cachePath.c_str(), nullptr);
+            debug("Reusing the tiles of %s from %s\n", file.c_str(), cachePath.c_str());
+            return;
+        }
+        fclose(tiles);
+        tiles = nullptr;
+    }
+
+    string directory = cachePath.substr(0, cachePath.rfind('/'));
+    if (makeDirectories(directory)){
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%d.tmp", (int) getpid());
+        buildPath = cachePath + suffix;
+        tiles = fopen(buildPath.c_str(), "w+b");
+    }
+    if (tiles == nullptr){
+        /* Works for this view, it just isn't kept */
+        buildPath = "";
+        cachePath = "";
+        tiles = tmpfile();
+    }
+}
+
+bool TiledImage::readIndex(){
+    struct stat info;
+    if (fstat(fileno(tiles), &info) != 0 || info.st_size < (off_t) sizeof(TilesFooter)){
+        return false;
+    }
+
+    TilesFooter footer;
+    if (pread(fileno(tiles), &footer, sizeof(footer), info.st_size - sizeof(footer)) != (ssize_t) sizeof(footer)){
+        return false;
+    }
+    if (memcmp(footer.magic, TILES_MAGIC, sizeof(TILES_MAGIC)) != 0 ||
+        footer.width != width || footer.height != height ||
+        footer.tileSize != TILE_SIZE || footer.levels != LEVELS){
+        return false;
+    }
+
+    int64_t position = footer.index;
+    for (int level = 0; level < LEVELS; level++){
+        size_t bytes = offsets[level].size() * sizeof(int64_t);
+        if (position < 0 || position + (int64_t) bytes > (int64_t) (info.st_size - sizeof(footer)) ||
+            pread(fileno(tiles), &offsets[level][0], bytes, position) != (ssize_t) bytes){
+            return false;
+        }
+        for (int64_t offset: offsets[level]){
+            if (offset < 0 || offset >= footer.index){
+                return false;
+            }
+        }
+        position += bytes;
+    }
+
+    return true;
+}
+
+void TiledImage::finish(){
+    if (writeFailed){
+        return;
+    }
+
+    int64_t position = tilesSize;
+    for (int level = 0; level < LEVELS; level++){
+        size_t bytes = offsets[level].size() * sizeof(int64_t);
+        /* The build is over so nothing else writes offsets */
+        if (pwrite(fileno(tiles), &offsets[level][0], bytes, position) != (ssize_t) bytes){
+            return;
+        }
+        position += bytes;
+    }
+
+    TilesFooter footer;
+    memcpy(footer.magic, TILES_MAGIC, sizeof(TILES_MAGIC));
+    footer.width = width;
+    footer.height = height;
+    footer.tileSize = TILE_SIZE;
+    footer.levels = LEVELS;
+    footer.index = tilesSize;
+    if (pwrite(fileno(tiles), &footer, sizeof(footer), position) != (ssize_t) sizeof(footer)){
+        return;
+    }
+
+    /* The reader keeps using the open file, it doesn't care about the name */
+    if (rename(buildPath.c_str(), cachePath.c_str()) == 0){
+        buildPath = "";
+        trimTiles(cachePath.substr(0, cachePath.rfind('/')), cachePath);
+    }
+}
+
+TiledImage::~TiledImage(){
+    al_lock_mutex(mutex);
+    stopped = true;
+    al_broadcast_cond(ready);
+    al_unlock_mutex(mutex);
+
+    /* The build polls isCancelled so this doesn't wait for the whole decode */
+    if (builder != nullptr){
+        al_join_thread(builder, nullptr);
+        al_destroy_thread(builder);
+    }
+    if (reader != nullptr){
+        al_join_thread(reader, nullptr);
+        al_destroy_thread(reader);
+    }
+
+    for (auto & cached: cache){
+        al_destroy_bitmap(cached.second.bitmap);
+    }
+
+    if (tiles != nullptr){
+        fclose(tiles);
+    }
+    if (buildPath != ""){
+        /* Cancelled or failed, only complete tile files are kept */
+        unlink(buildPath.c_str());
+    }
+
+    al_destroy_cond(ready);
+    al_destroy_mutex(mutex);
+}
+
+int TiledImage::levelWidth(int level) const {
+    int out = width;
+    for (int i = 0; i < level; i++){
+        out = (out + 1) / 2;
+    }
+    return out;
+}
+
+int TiledImage::levelHeight(int level) const {
+    int out = height;
+    for (int i = 0; i < level; i++){
+        out = (out + 1) / 2;
+    }
+    return out;
+}
+
+int TiledImage::columns(int level) const {
+    return (levelWidth(level) + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+int TiledImage::rows(int level) const {
+    return (levelHeight(level) + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+bool TiledImage::isCancelled() const {
+    bool out = false;
+    al_lock_mutex(mutex);
+    out = stopped;
+    al_unlock_mutex(mutex);
+    return out || quitting();
+}
+
+void TiledImage::notify(TileResult * result){
+    ALLEGRO_EVENT event;
+    event.user.type = TILE_TYPE;
+    event.user.data1 = (intptr_t) result;
+    event.user.data2 = id;
+    al_emit_user_event(events, &event, nullptr);
+    stats.eventSent();
+}
+
+void * TiledImage::runBuild(ALLEGRO_THREAD * self, void * data){
+    TiledImage * image = (TiledImage*) data;
+    image->build();
+    return nullptr;
+}
+
+void TiledImage::build(){
+    double start = al_get_time();
+    if (readJpegRows(file, *this, this)){
+        /* The last strips are partly filled, each one adds to the next level */
+        for (int level = 0; level < LEVELS; level++){
+            flushStrip(level);
+        }
+        debug("Built %d levels of %s in %f\n", LEVELS, file.c_str(), al_get_time() - start);
+        stats.tiled((al_get_time() - start) * 1000);
+        if (buildPath != ""){
+            finish();
+        }
+    }
+
+    for (int level = 0; level < LEVELS; level++){
+        vector<unsigned char>().swap(strips[level]);
+    }
+}
+
+bool TiledImage::size(int width, int height){
+    if (width != this->width || height != this->height){
+        return false;
+    }
+
+    for (int level = 0; level < LEVELS; level++){
+        strips[level].resize((size_t) levelWidth(level) * TILE_SIZE * 4);
+    }
+    return true;
+}
+
+bool TiledImage::row(const unsigned char * pixels){
+    size_t pitch = (size_t) width * 4;
+    memcpy(&strips[0][stripLines[0] * pitch], pixels, pitch);
+    stripLines[0] += 1;
+    if (stripLines[0] == TILE_SIZE){
+        flushStrip(0);
+    }
+    return true;
+}
+
+void TiledImage::flushStrip(int level){
+    int lines = stripLines[level];
+    if (lines == 0){
+        return;
+    }
+
+    int lineWidth = levelWidth(level);
+    size_t pitch = (size_t) lineWidth * 4;
+
+    /* Tiles are stored one after the other with no padding */
+    vector<unsigned char> tile(TILE_SIZE * TILE_SIZE * 4);
+    for (int column = 0; column < columns(level); column++){
+        int tileWidth = std::min(TILE_SIZE, lineWidth - column * TILE_SIZE);
+        for (int line = 0; line < lines; line++){
+            memcpy(&tile[line * tileWidth * 4], &strips[level][line * pitch + column * TILE_SIZE * 4], tileWidth * 4);
+        }
+
+        size_t bytes = (size_t) tileWidth * lines * 4;
+        if (pwrite(fileno(tiles), &tile[0], bytes, tilesSize) != (ssize_t) bytes){
+            /* Out of disk, the rest is drawn from the fallback */
+            writeFailed = true;
+            continue;
+        }
+
+        al_lock_mutex(mutex);
+        offsets[level][stripRow[level] * columns(level) + column] = tilesSize;
+        al_unlock_mutex(mutex);
+        tilesSize += bytes;
+    }
+
+    if (level + 1 < LEVELS){
+        int nextWidth = levelWidth(level + 1);
+        int nextLines = (lines + 1) / 2;
+        size_t nextPitch = (size_t) nextWidth * 4;
+        shrinkPixels(&strips[level][0], pitch, lineWidth, lines,
+                     &strips[level + 1][stripLines[level + 1] * nextPitch], nextPitch, nextWidth, nextLines);
+        stripLines[level + 1] += nextLines;
+        if (stripLines[level + 1] == TILE_SIZE){
+            flushStrip(level + 1);
+        }
+    }
+
+    stripLines[level] = 0;
+    stripRow[level] += 1;
+
+    /* The view asks for the tiles it is missing again */
+    notify(nullptr);
+}
+
+void * TiledImage::runRead(ALLEGRO_THREAD * self, void * data){
+    TiledImage * image = (TiledImage*) data;
+    image->read();
+    return nullptr;
+}
+
+ALLEGRO_BITMAP * TiledImage::readTile(const Key & key){
+    al_lock_mutex(mutex);
+    int64_t offset = offsets[key.level][key.row * columns(key.level) + key.column];
+    al_unlock_mutex(mutex);
+    if (offset < 0){
+        /* Not built yet */
+        return nullptr;
+    }
+
+    int tileWidth = std::min(TILE_SIZE, levelWidth(key.level) - key.column * TILE_SIZE);
+    int tileHeight = std::min(TILE_SIZE, levelHeight(key.level) - key.row * TILE_SIZE);
+
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    ALLEGRO_BITMAP * out = al_create_bitmap(tileWidth, tileHeight);
+    if (out == nullptr){
+        return nullptr;
+    }
+
+    ALLEGRO_LOCKED_REGION * region = al_lock_bitmap(out, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+    if (region == nullptr){
+        al_destroy_bitmap(out);
+        return nullptr;
+    }
+
+    bool ok = true;
+    size_t bytes = (size_t) tileWidth * 4;
+    if (region->pitch == (int) bytes){
+        ok = pread(fileno(tiles), region->data, bytes * tileHeight, offset) == (ssize_t) (bytes * tileHeight);
+    } else {
+        for (int line = 0; line < tileHeight && ok; line++){
+            ok = pread(fileno(tiles), (unsigned char *) region->data + line * region->pitch, bytes, offset + line * bytes) == (ssize_t) bytes;
+        }
+    }
+    al_unlock_bitmap(out);
+
+    if (!ok){
+        al_destroy_bitmap(out);
+        return nullptr;
+    }
+    return out;
+}
+
+void TiledImage::read(){
+    while (true){
+        Key next;
+        al_lock_mutex(mutex);
+        while (pending.size() == 0 && !stopped){
+            al_wait_cond(ready, mutex);
+        }
+        if (stopped){
+            al_unlock_mutex(mutex);
+            break;
+        }
+        next = pending.front();
+        pending.pop_front();
+        al_unlock_mutex(mutex);
+
+        ALLEGRO_BITMAP * bitmap = readTile(next);
+        if (bitmap == nullptr){
+            continue;
+        }
+
+        TileResult * result = new TileResult();
+        result->image = id;
+        result->level = next.level;
+        result->column = next.column;
+        result->row = next.row;
+        result->bitmap = bitmap;
+        notify(result);
+    }
+}
+
+void TiledImage::request(const vector<Key> & wanted){
+    al_lock_mutex(mutex);
+    pending.assign(wanted.begin(), wanted.end());
+    al_broadcast_cond(ready);
+    al_unlock_mutex(mutex);
+}
+
+void TiledImage::built(){
+    /* Tiles that weren't built yet are asked for again by the next draw */
+    lastRequested.clear();
+}
+
+void TiledImage::addTile(TileResult * result){
+    if (result->bitmap == nullptr){
+        return;
+    }
+
+    Key key;
+    key.level = result->level;
+    key.column = result->column;
+    key.row = result->row;
+    if (cache.find(key) != cache.end()){
+        al_destroy_bitmap(result->bitmap);
+        return;
+    }
+
+    /* Drawn at all sorts of scales so filter it */
+    int oldFlags = al_get_new_bitmap_flags();
+    al_set_new_bitmap_flags(ALLEGRO_VIDEO_BITMAP | ALLEGRO_MIN_LINEAR | ALLEGRO_MAG_LINEAR);
+    double start = al_get_time();
+    al_convert_bitmap(result->bitmap);
+    stats.uploaded((al_get_time() - start) * 1000);
+    al_set_new_bitmap_flags(oldFlags);
+
+    Tile tile;
+    tile.bitmap = result->bitmap;
+    tile.used = frame;
+    cache[key] = tile;
+
+    /* Throw away the tiles that weren't drawn for the longest time */
+    while (cache.size() > MAX_TILES){
+        auto oldest = cache.begin();
+        for (auto it = cache.begin(); it != cache.end(); it++){
+            if (it->second.used < oldest->second.used){
+                oldest = it;
+            }
+        }
+        al_destroy_bitmap(oldest->second.bitmap);
+        cache.erase(oldest);
+    }
+}
+
+void TiledImage::draw(ALLEGRO_BITMAP * fallback, double x, double y, double scale, int screenWidth, int screenHeight){
+    frame += 1;
+
+    double fallbackScale = (double) al_get_bitmap_width(fallback) / width;
+
+    /* The coarsest level that still has a pixel for every screen pixel */
+    int level = 0;
+    while (level + 1 < LEVELS && scale <= 1.0 / (1 << (level + 1))){
+        level += 1;
+    }
+
+    if (fallbackScale >= scale || tiles == nullptr){
+        /* The small version is enough */
+        al_draw_scaled_bitmap(fallback, 0, 0, al_get_bitmap_width(fallback), al_get_bitmap_height(fallback),
+                              x, y, width * scale, height * scale, 0);
+        return;
+    }
+
+    /* Size of a tile of this level on screen */
+    double size = TILE_SIZE * (1 << level) * scale;
+    int firstColumn = std::max(0, (int) floor(-x / size));
+    int lastColumn = std::min(columns(level) - 1, (int) floor((screenWidth - x) / size));
+    int firstRow = std::max(0, (int) floor(-y / size));
+    int lastRow = std::min(rows(level) - 1, (int) floor((screenHeight - y) / size));
+
+    vector<Key> wanted;
+    for (int row = firstRow; row <= lastRow; row++){
+        for (int column = firstColumn; column <= lastColumn; column++){
+            Key key;
+            key.level = level;
+            key.column = column;
+            key.row = row;
+
+            /* Part of the picture the tile covers */
+            double pictureX = column * TILE_SIZE * (1 << level);
+            double pictureY = row * TILE_SIZE * (1 << level);
+            double pictureWidth = std::min((double) TILE_SIZE * (1 << level), width - pictureX);
+            double pictureHeight = std::min((double) TILE_SIZE * (1 << level), height - pictureY);
+
+            auto found = cache.find(key);
+            if (found != cache.end()){
+                found->second.used = frame;
+                ALLEGRO_BITMAP * bitmap = found->second.bitmap;
+                al_draw_scaled_bitmap(bitmap, 0, 0, al_get_bitmap_width(bitmap), al_get_bitmap_height(bitmap),
+                                      x + pictureX * scale, y + pictureY * scale,
+                                      pictureWidth * scale, pictureHeight * scale, 0);
+            } else {
+                al_draw_scaled_bitmap(fallback,
+                                      pictureX * fallbackScale, pictureY * fallbackScale,
+                                      pictureWidth * fallbackScale, pictureHeight * fallbackScale,
+                                      x + pictureX * scale, y + pictureY * scale,
+                                      pictureWidth * scale, pictureHeight * scale, 0);
+                wanted.push_back(key);
+            }
+        }
+    }
+
+    if (!(wanted == lastRequested)){
+        request(wanted);
+        lastRequested = wanted;
+    }
+}
@@ -0,0 +1,189 @@
+#ifndef _viewer_tiles_h
+#define _viewer_tiles_h
+
+#include <allegro5/allegro.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+#include "cancel.h"
+#include "jpeg.h"
+
+/* Pictures with a side longer than this or more pixels than HUGE_PIXELS don't
+ * fit in a texture (or in memory for long) so they are never loaded at full size.
+ * The image manager loads them scaled down to fit in HUGE_FIT and the fullscreen
+ * view shows them from tiles.
+ */
+const int HUGE_SIDE = 8192;
+const int64_t HUGE_PIXELS = 64 * 1024 * 1024;
+const int HUGE_FIT = 4096;
+
+bool isHuge(int width, int height);
+
+/* Sent with TILE_TYPE when a tile was read. The image is the TiledImage's id,
+ * whoever gets the event owns the bitmap.
+ */
+struct TileResult{
+    int image;
+    int level;
+    int column;
+    int row;
+    ALLEGRO_BITMAP * bitmap;
+};
+
+/* Shows a huge picture at any zoom with memory and uploads that depend on the
+ * size of the screen rather than the picture.
+ *
+ * A thread decodes the picture once, a line at a time, and cuts it into tiles
+ * of TILE_SIZE pixels for LEVELS levels, each half the size of the one before.
+ * The tiles go to a file as they are made. Only one strip of tiles per level is
+ * in memory at a time, so this depends on the width of the picture.
+ *
+ * The file lives in the cache directory, named by the path, size and modification
+ * time of the picture like the thumbnail cache, and is kept once it is complete.
+ * Viewing the same picture again reads the tiles from it without decoding
+ * anything. The oldest tile files are removed when they take more than
+ * CACHE_BYTES. Without a cache directory the tiles go to a temporary file.
+ *
+ * Drawing picks the level for the zoom and asks for the tiles on screen. Another
+ * thread reads them from the file and sends them as TILE_TYPE events, and the
+ * most recently drawn ones are kept as video bitmaps. Tiles that aren't there yet
+ * are drawn from a small version of the whole picture, which is also used when
+ * the picture is zoomed out beyond the last level.
+ *
+ * Everything but the constructor and isCancelled must be called from the thread
+ * that draws.
+ */
+class TiledImage: public Cancel, public JpegRows{
+public:
+    static const int TILE_SIZE = 256;
+    static const int LEVELS = 3;
+    /* Video bitmaps of tiles that are kept, enough for a few screens */
+    static const unsigned int MAX_TILES = 256;
+    /* Disk used by the tile files of every picture */
+    static const int64_t CACHE_BYTES = (int64_t) 8 * 1024 * 1024 * 1024;
+
+    /* width and height are the size of the jpeg */
+    TiledImage(const std::string & file, int width, int height, ALLEGRO_EVENT_SOURCE * events);
+    virtual ~TiledImage();
+
+    int getWidth() const {
+        return width;
+    }
+
+    int getHeight() const {
+        return height;
+    }
+
+    /* Different for every TiledImage made */
+    int getId() const {
+        return id;
+    }
+
+    /* Draws the picture with its top left corner at x, y and scale screen pixels
+     * for each pixel of the picture. fallback is the whole picture at any size.
+     */
+    void draw(ALLEGRO_BITMAP * fallback, double x, double y, double scale, int screenWidth, int screenHeight);
+
+    /* A TILE_TYPE event for this image. Takes the bitmap, result can be deleted. */
+    void addTile(TileResult * result);
+
+    /* A TILE_TYPE event without a tile, more tiles were built */
+    void built();
+
+    /* Tells the build to stop when the image is going away */
+    virtual bool isCancelled() const;
+
+    /* Called by the build with the lines of the picture */
+    virtual bool size(int width, int height);
+    virtual bool row(const unsigned char * pixels);
+
+protected:
+    struct Key{
+        int level;
+        int column;
+        int row;
+
+        bool operator<(const Key & other) const {
+            if (level != other.level){
+                return level < other.level;
+            }
+            if (row != other.row){
+                return row < other.row;
+            }
+            return column < other.column;
+        }
+
+        bool operator==(const Key & other) const {
+            return level == other.level && column == other.column && row == other.row;
+        }
+    };
+
+    struct Tile{
+        ALLEGRO_BITMAP * bitmap;
+        /* The last draw that used it */
+        int64_t used;
+    };
+
+    /* Opens the kept tile file or starts a new one */
+    void openTiles();
+    /* Reads the index of a complete tile file, false if it isn't usable */
+    bool readIndex();
+    /* Adds the index to the end of the file and moves it to cachePath */
+    void finish();
+
+    static void * runBuild(ALLEGRO_THREAD * self, void * data);
+    static void * runRead(ALLEGRO_THREAD * self, void * data);
+    void build();
+    void read();
+    ALLEGRO_BITMAP * readTile(const Key & key);
+    /* Writes the full strip of a level to the file and shrinks it into the next one */
+    void flushStrip(int level);
+    void notify(TileResult * result);
+    void request(const std::vector<Key> & wanted);
+
+    int levelWidth(int level) const;
+    int levelHeight(int level) const;
+    int columns(int level) const;
+    int rows(int level) const;
+
+    const std::string file;
+    const int width;
+    const int height;
+    const int id;
+    ALLEGRO_EVENT_SOURCE * events;
+    ALLEGRO_THREAD * builder;
+    ALLEGRO_THREAD * reader;
+
+    ALLEGRO_MUTEX * mutex;
+    /* Signalled when there are tiles to read or its time to stop */
+    ALLEGRO_COND * ready;
+    bool stopped;
+    /* Where each tile is in the file by level, row and column, -1 until built */
+    std::vector<int64_t> offsets[LEVELS];
+    std::deque<Key> pending;
+
+    /* Where the complete tile file is kept, empty without a cache directory */
+    std::string cachePath;
+
+    /* Only used by the build */
+    FILE * tiles;
+    int64_t tilesSize;
+    /* The file being built, renamed to cachePath once its done */
+    std::string buildPath;
+    /* Some tile couldn't be written so the file isn't kept */
+    bool writeFailed;
+    std::vector<unsigned char> strips[LEVELS];
+    int stripLines[LEVELS];
+    int stripRow[LEVELS];
+
+    /* Only used by the drawing thread */
+    std::map<Key, Tile> cache;
+    int64_t frame;
+    std::vector<Key> lastRequested;
+};
+
+#endif
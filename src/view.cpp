@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <allegro5/allegro.h>
 #include <allegro5/allegro_image.h>
 #include <allegro5/allegro_primitives.h>
@@ -11,403 +13,233 @@
 #include <math.h>
 #include <iostream>
 
+#include "events.h"
+#include "load.h"
+#include "image-manager.h"
+#include "stats.h"
+#include "levels.h"
+#include "resize.h"
+#include "arena.h"
+#include "scan.h"
+#include "tiles.h"
+
 using std::vector;
 using std::string;
 
-/* Event for when a new thumbnail is loaded */
-const unsigned int VIEW_TYPE = ALLEGRO_GET_EVENT_TYPE('V', 'I', 'E', 'W');
-
-/* Event for when a percent of the files searched is incremented by at least 1 */
-const unsigned int PERCENT_TYPE = ALLEGRO_GET_EVENT_TYPE('P', 'R', 'C', 'T');
-
-/* Event for when an image request is done loading */
-const unsigned int LOAD_TYPE = ALLEGRO_GET_EVENT_TYPE('L', 'O', 'A', 'D');
-
 // #define debug(...) printf(__VA_ARGS__)
 #define debug(...)
 
-ALLEGRO_MUTEX * globalQuit;
-bool doQuit = false;
-
-struct Image{
-    Image(ALLEGRO_BITMAP * thumbnail, const string & name):
-        thumbnail(thumbnail),
-        video(nullptr),
-        filename(name){
-        }
-
-    ALLEGRO_BITMAP * thumbnail;
-    /* Video copy of the thumbnail */
-    ALLEGRO_BITMAP * video;
-    string filename;
-};
-
-/*
-static bool sortImage(Image * a, Image * b){
-    return a->filename < b->filename;
-}
-*/
-
-/* Loads images in the background and returns the current image when its available.
+/* Holds the video copies of the thumbnails that are on screen.
  *
- * There should be N worker threads, probably 2 or 3, that just loop waiting to be
- * given work. The work will be in the form of a filename that they should use to
- * load a bitmap with al_load_bitmap. This will return a memory bitmap that will be
- * sent back to the manager.
+ * Instead of a separate texture per thumbnail the thumbnails are copied into
+ * cells of a few large video bitmaps (pages). Drawing sub bitmaps of the same page
+ * while bitmap drawing is held lets allegro batch the whole grid into a handful
+ * of draw calls. Pages are never destroyed while the program runs, cells that
+ * scroll off screen are just handed out again.
  *
- * The manager should create a mailbox that contains a mutex and a boolean that says
- * when the mailbox is full. The worker will place the memory bitmap in the mailbox.
+ * The cells are as big as the current thumbnail level. Thumbnails that are bigger
+ * than a cell are shrunk on the way in.
  */
-class ImageManager{
+class ThumbnailAtlas{
 public:
-    static const int MAX_WORKERS = 2;
-
-    class Mailbox{
-    public:
-        Mailbox(const string & file, ALLEGRO_EVENT_SOURCE * events):
-        file(file),
-        count(0),
-        events(events),
-        bitmap(nullptr){
-            mutex = al_create_mutex();
-        }
-
-        ~Mailbox(){
-            al_destroy_mutex(mutex);
-        }
+    static const int PAGE_SIZE = 1024;
 
-        void inc(){
-            al_lock_mutex(mutex);
-            this->count += 1;
-            al_unlock_mutex(mutex);
-        }
-
-        void dec(){
-            al_lock_mutex(mutex);
-            this->count -= 1;
-            al_unlock_mutex(mutex);
-        }
-
-        int getCount() const {
-            int out = 0;
-            al_lock_mutex(mutex);
-            out = this->count;
-            al_unlock_mutex(mutex);
-            return out;
-        }
-
-        const string getFile() const {
-            return file;
-        }
-
-        void setBitmap(ALLEGRO_BITMAP * bitmap){
-            al_lock_mutex(mutex);
-            this->bitmap = bitmap;
-            al_unlock_mutex(mutex);
-
-            if (bitmap != nullptr){
-                /* When the mailbox is loaded with a bitmap we output
-                 * a load event to tell the main thread to redraw if necessary.
-                 */
-                ALLEGRO_EVENT event;
-                event.user.type = LOAD_TYPE;
-                al_emit_user_event(events, &event, nullptr);
-            }
-        }
+    ThumbnailAtlas():
+    cell(THUMBNAIL_SIZE){
+    }
 
-        ALLEGRO_BITMAP * getBitmap(){
-            ALLEGRO_BITMAP * out = nullptr;
-            al_lock_mutex(mutex);
-            out = this->bitmap;
-            al_unlock_mutex(mutex);
-            return out;
+    ~ThumbnailAtlas(){
+        for (ALLEGRO_BITMAP * page: pages){
+            al_destroy_bitmap(page);
         }
+    }
 
-        const string file;
-        /* The number of tasks that reference this mailbox */
-        int count;
-        ALLEGRO_EVENT_SOURCE * events;
-        ALLEGRO_MUTEX * mutex;
-        ALLEGRO_BITMAP * bitmap;
-    };
-
-    class Task{
-    public:
-        Task(Mailbox * box):
-        box(box){
-            box->inc();
+    /* Copies the thumbnail (or its level if it has one) into a free cell and sets
+     * the image's video bitmap
+     */
+    void add(Image * image){
+        /* The pixels come from the level bitmap, straight from the arena or from
+         * a shrunk copy of the arena pixels.
+         */
+        ALLEGRO_BITMAP * level = nullptr;
+        const Thumbnail * direct = nullptr;
+        vector<unsigned char> shrunk;
+        int width = 0;
+        int height = 0;
+
+        if (image->level != nullptr && al_get_bitmap_width(image->level) <= cell && al_get_bitmap_height(image->level) <= cell){
+            level = image->level;
+            width = al_get_bitmap_width(level);
+            height = al_get_bitmap_height(level);
+        } else if (image->thumbnail == nullptr){
+            /* Evicted, the view restores visible thumbnails before adding them */
+            return;
+        } else if (image->thumbnail->width <= cell && image->thumbnail->height <= cell){
+            direct = image->thumbnail;
+            width = direct->width;
+            height = direct->height;
+        } else {
+            int fullWidth = image->thumbnail->width;
+            int fullHeight = image->thumbnail->height;
+            double scale = std::min((double) cell / fullWidth, (double) cell / fullHeight);
+            width = std::max(1, (int)(fullWidth * scale));
+            height = std::max(1, (int)(fullHeight * scale));
+            vector<unsigned char> full(fullWidth * fullHeight * 4);
+            ThumbnailArena::read(image->thumbnail, &full[0], fullWidth * 4);
+            shrunk.resize(width * height * 4);
+            shrinkPixels(&full[0], fullWidth * 4, fullWidth, fullHeight, &shrunk[0], width * 4, width, height);
         }
 
-        ~Task(){
-            box->dec();
+        if (free.size() == 0 && !addPage()){
+            return;
         }
 
-        Mailbox * getBox(){
-            return box;
-        }
+        int slot = free.back();
+        free.pop_back();
 
-        Mailbox * box;
-    };
+        ALLEGRO_BITMAP * page = pages[slot / cellsPage()];
+        int x = (slot % cellsPage()) % cellsLine() * cell;
+        int y = (slot % cellsPage()) / cellsLine() * cell;
 
-    /* Contains a list of tasks that can be taken off by workers */
-    class TaskList{
-    public:
-        TaskList(){
-            mutex = al_create_mutex();
+        /* Locking just the cell uploads only that part of the page */
+        ALLEGRO_LOCKED_REGION * to = al_lock_bitmap_region(page, x, y, width, height, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+        if (to == nullptr){
+            free.push_back(slot);
+            return;
         }
 
-        ~TaskList(){
-            /* Hopefully no one is using this task list at this point. What
-             * a fun potential race! Good job c++!
-             */
-            al_destroy_mutex(mutex);
-            for (Task * task: tasks){
-                delete task;
+        if (direct != nullptr){
+            ThumbnailArena::read(direct, (unsigned char *) to->data, to->pitch);
+        } else {
+            const unsigned char * pixels = shrunk.size() > 0 ? &shrunk[0] : nullptr;
+            int pitch = width * 4;
+            ALLEGRO_LOCKED_REGION * from = nullptr;
+            if (level != nullptr){
+                from = al_lock_bitmap(level, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+                if (from != nullptr){
+                    pixels = (const unsigned char *) from->data;
+                    pitch = from->pitch;
+                }
             }
-        }
-
-        /* Pull the first task off the list. Whoever gets the task must
-         * take care to delete it.
-         */
-        Task * getTask(){
-            Task * out = nullptr;
-            al_lock_mutex(mutex);
-            if (tasks.size() > 0){
-                out = tasks[0];
-                tasks.erase(tasks.begin());
+            if (pixels != nullptr){
+                for (int line = 0; line < height; line++){
+                    memcpy((unsigned char *) to->data + line * to->pitch, pixels + line * pitch, width * 4);
+                }
             }
-            al_unlock_mutex(mutex);
-            return out;
-        }
-
-        /* Adds a task to the front of the work queue */
-        void addTask(Task * task){
-            al_lock_mutex(mutex);
-            /* We actually don't care about old tasks so just erase them */
-            for (Task * task: tasks){
-                delete task;
+            if (from != nullptr){
+                al_unlock_bitmap(level);
             }
-            tasks.clear();
-            tasks.insert(tasks.begin(), task);
-            al_unlock_mutex(mutex);
         }
+        al_unlock_bitmap(page);
 
-        ALLEGRO_MUTEX * mutex;
-        vector<Task*> tasks;
-    };
-
-    /* Loads threads in the background */
-    class Worker{
-    public:
-        Worker(TaskList & tasks):
-        isAlive(true),
-        tasks(tasks){
-            aliveMutex = al_create_mutex();
-            thread = nullptr;
-        }
+        image->slot = slot;
+        image->video = al_create_sub_bitmap(page, x, y, width, height);
+        owners[slot] = image;
+    }
 
-        ~Worker(){
-            kill();
-            al_join_thread(thread, nullptr);
-            al_destroy_mutex(aliveMutex);
+    /* Gives the image's cell back */
+    void remove(Image * image){
+        if (image->video != nullptr){
+            al_destroy_bitmap(image->video);
+            image->video = nullptr;
         }
-
-        void start(){
-            thread = al_create_thread(run, this);
-            al_start_thread(thread);
+        if (image->slot != -1){
+            free.push_back(image->slot);
+            owners[image->slot] = nullptr;
+            image->slot = -1;
         }
+    }
 
-        bool isAlive;
-        ALLEGRO_MUTEX * aliveMutex;
-        ALLEGRO_THREAD * thread;
-        TaskList & tasks;
+    /* Total number of cells */
+    int size() const {
+        return owners.size();
+    }
 
-        void load(Mailbox * box){
-            al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
-            ALLEGRO_BITMAP * out = al_load_bitmap(box->getFile().c_str());
-            box->setBitmap(out);
+    /* Changes the size of the cells, every image loses its cell */
+    void setCellSize(int size){
+        if (size == cell){
+            return;
         }
 
-        /* Polls for a task */
-        Task * nextTask(){
-            while (alive()){
-                Task * next = tasks.getTask();
-                if (next != nullptr){
-                    return next;
-                }
-                al_rest(0.001);
+        for (unsigned int slot = 0; slot < owners.size(); slot++){
+            if (owners[slot] != nullptr){
+                remove(owners[slot]);
             }
-            return nullptr;
-        }
-
-        bool alive(){
-            bool out = false;
-            al_lock_mutex(aliveMutex);
-            out = isAlive;
-            al_unlock_mutex(aliveMutex);
-            return out;
-        }
-
-        void kill(){
-            al_lock_mutex(aliveMutex);
-            isAlive = false;
-            al_unlock_mutex(aliveMutex);
         }
 
-        void work(){
-            while (alive()){
-                /* nextMailbox will sleep until theres something ready */
-                Task * next = nextTask();
-                /* We might have died while waiting for a task */
-                if (alive() && next != nullptr){
-                    load(next->getBox());
-                }
-
-                /* We are done with the task */
-                delete next;
-            }
-        }
-
-        static void * run(ALLEGRO_THREAD * thread, void * self){
-            Worker * worker = (Worker*) self;
-            worker->work();
-            return nullptr;
-        }
-    };
-
-    ImageManager(ALLEGRO_EVENT_SOURCE * events):
-    currentBitmap(nullptr),
-    events(events){
-        for (int i = 0; i < MAX_WORKERS; i++){
-            Worker * worker = new Worker(tasks);
-            worker->start();
-            workers.push_back(worker);
+        cell = size;
+        free.clear();
+        owners.clear();
+        for (unsigned int page = 0; page < pages.size(); page++){
+            addCells(page);
         }
     }
 
-    ~ImageManager(){
-        /* We kill all the workers so in theory there should be no one using
-         * the task list when its destructor runs.
-         */
-        for (Worker * worker: workers){
-            delete worker;
-        }
-
-        /* There is an interesting race here. The task list class will delete all
-         * existing tasks but they are referencing mailboxes. We can't delete the
-         * mailboxes first because the Task destructor will call box->dec(). We need
-         * to somehow delete the mailboxes after the task list destructor runs.
-         * I suppose the task list could be made a pointer so we can manually
-         * schedule its deletion and then delete all the remaining mailboxes afterwards.
-         *
-         * In reality the number of tasks/mailboxes will be pretty small since workers
-         * only hold onto 1 task at a time and the task list really only contains
-         * 1 task list in its queue. So 3 tasks/mailboxes at most..
-         */
-
-        if (currentBitmap != nullptr){
-            al_destroy_bitmap(currentBitmap);
-        }
+    /* The image using a cell or nullptr */
+    Image * owner(int slot) const {
+        return owners[slot];
     }
 
-    /* Delete any mailboxes that are complete but dont match the current file */
-    void cleanOldMailboxes(const string & filename){
-        /* C++11 note: Not sure if its a good idea to use auto here.
-         * Also, can we not use ranged for because we might delete something while iterating?
-         */
-        for (auto it = mailboxes.begin(); it != mailboxes.end(); /**/){
-            Mailbox * box = *it;
-
-            /* Delete the mailbox if it uses a file we dont care about
-             * and its not reference by a task either because its completed
-             * or because the task was removed from the queue before it
-             * was started.
-             *
-             * The mailbox might be reference by a task currently being processed
-             * by a worker and so the count will be non-zero.
-             */
-            if (box->getFile() != filename &&
-                box->getCount() == 0){
-
-                /* The bitmap in the mailbox may not have been loaded or a
-                 * load was attempted but failed so the bitmap remains nullptr.
-                 */
-                ALLEGRO_BITMAP * bitmap = box->getBitmap();
-                if (bitmap != nullptr){
-                    al_destroy_bitmap(bitmap);
-                }
-                delete box;
-                it = mailboxes.erase(it);
-            } else {
-                it++;
-            }
-        }
+protected:
+    int cellsLine() const {
+        return PAGE_SIZE / cell;
     }
 
-    ALLEGRO_BITMAP * get(const string & filename){
-        if (filename == currentFile && currentBitmap != nullptr){
-            return currentBitmap;
-        }
+    int cellsPage() const {
+        return cellsLine() * cellsLine();
+    }
 
-        /* Its a new file so clear the old state */
-        currentFile = filename;
-        if (currentBitmap != nullptr){
-            al_destroy_bitmap(currentBitmap);
-            currentBitmap = nullptr;
+    bool addPage(){
+        al_set_new_bitmap_flags(ALLEGRO_VIDEO_BITMAP);
+        ALLEGRO_BITMAP * page = al_create_bitmap(PAGE_SIZE, PAGE_SIZE);
+        al_set_new_bitmap_flags(ALLEGRO_CONVERT_BITMAP);
+        if (page == nullptr){
+            return false;
         }
 
-        cleanOldMailboxes(filename);
-
-        /* Search for the mailbox that contains the given filename and check
-         * if its done loading the bitmap.
-         */
-        for (vector<Mailbox*>::iterator it = mailboxes.begin(); it != mailboxes.end(); it++){
-            Mailbox * box = *it;
-            if (box->getFile() == filename){
-                ALLEGRO_BITMAP * use = box->getBitmap();
-                if (use != nullptr){
-                    /* We found a mailbox that was done loading so
-                     * convert the loaded bitmap to a video one
-                     * and destroy the mailbox.
-                     */
-                    if (currentBitmap != nullptr){
-                        al_destroy_bitmap(currentBitmap);
-                    }
+        pages.push_back(page);
+        addCells(pages.size() - 1);
+        return true;
+    }
 
-                    currentBitmap = use;
-                    /* Convert it from memory to video */
-                    al_convert_bitmap(use);
-                    delete box;
-                    /* Its ok to erase even with the it++ in the for loop because we are going
-                     * to return immediately so we will never get to the next it++
-                     */
-                    mailboxes.erase(it);
-                    return currentBitmap;
-                } else {
-                    /* Otherwise theres already a box for this bitmap so we
-                     * must be waiting for it to complete.
-                     */
-                    return nullptr;
-                }
-            }
+    /* Makes the cells of a page free */
+    void addCells(int page){
+        /* Hand out the first cells first */
+        int first = page * cellsPage();
+        for (int slot = first + cellsPage() - 1; slot >= first; slot--){
+            free.push_back(slot);
         }
+        owners.resize(first + cellsPage(), nullptr);
+    }
 
-        /* No matching mailboxes so make a new one and add it to the task list */
-        Mailbox * box = new Mailbox(filename, events);
-        mailboxes.push_back(box);
+    /* Width and height of a cell */
+    int cell;
+    vector<ALLEGRO_BITMAP*> pages;
+    /* Cells that are not in use */
+    vector<int> free;
+    /* The image in each cell */
+    vector<Image*> owners;
+};
 
-        tasks.addTask(new Task(box));
+static bool sortImage(Image * a, Image * b){
+    return strcmp(a->filename, b->filename) < 0;
+}
 
-        return nullptr;
+/* A rectangle of the screen, x2 and y2 are not included */
+struct Region{
+    Region(int x1, int y1, int x2, int y2):
+    x1(x1),
+    y1(y1),
+    x2(x2),
+    y2(y2){
     }
 
-    vector<Worker*> workers;
-    vector<Mailbox*> mailboxes;
-    TaskList tasks;
+    bool intersects(const Region & other) const {
+        return x1 < other.x2 && other.x1 < x2 &&
+               y1 < other.y2 && other.y1 < y2;
+    }
 
-    string currentFile;
-    ALLEGRO_BITMAP * currentBitmap;
-    ALLEGRO_EVENT_SOURCE * events;
+    int x1, y1, x2, y2;
 };
 
 class View{
@@ -420,20 +252,131 @@ public:
     show(0),
     scroll(0),
     percent(0),
+    thumbnailBudget(DEFAULT_THUMBNAIL_BYTES),
+    canvas(nullptr),
+    dirtyAll(true),
+    dirtyTop(false),
+    dirtyText(false),
+    showStats(false),
+    level(levelFor(40)),
+    levels(events),
+    lastRequestedLevel(0),
+    preview(nullptr),
+    previewImage(nullptr),
+    queue(nullptr),
     manager(events){
+        atlas.setCellSize(level);
     }
 
     ~View(){
-        for (Image * image: images){
-            if (image->thumbnail != nullptr){
-                al_destroy_bitmap(image->thumbnail);
-            }
-            if (image->video != nullptr){
-                al_destroy_bitmap(image->video);
-            }
+        /* Files that couldn't be thumbnailed are only in here */
+        for (Image * image: found){
+            releaseLevel(image);
+            atlas.remove(image);
 
             delete image;
         }
+
+        if (canvas != nullptr){
+            al_destroy_bitmap(canvas);
+        }
+
+        if (preview != nullptr){
+            al_destroy_bitmap(preview);
+        }
+    }
+
+    /* Everything has to be drawn again */
+    void invalidate(){
+        dirtyAll = true;
+    }
+
+    /* The current image has to be drawn again */
+    void invalidateTop(){
+        dirtyTop = true;
+    }
+
+    /* The image counter or the progress text changed */
+    void invalidateText(){
+        dirtyText = true;
+    }
+
+    /* The thumbnail at the given index changed, only matters if its visible */
+    void invalidateImage(ALLEGRO_DISPLAY * display, int index){
+        if (index >= scroll && index < scroll + maxThumbnails(display)){
+            dirtyImages.push_back(index);
+        }
+    }
+
+    bool isDirty() const {
+        return dirtyAll || dirtyTop || dirtyText || dirtyImages.size() > 0;
+    }
+
+    void clean(){
+        dirtyAll = false;
+        dirtyTop = false;
+        dirtyText = false;
+        dirtyImages.clear();
+    }
+
+    /* Region of the screen covered by the thumbnail at the given index, plus
+     * room for the selection rectangle around it.
+     */
+    Region imageRegion(ALLEGRO_DISPLAY * display, int index) const {
+        int line = thumbnailsLine(display);
+        int column = (index - scroll) % line;
+        int row = (index - scroll) / line;
+        int x = 1 + column * (thumbnailWidth + thumbnailWidthSpace);
+        int y = al_get_display_height(display) / 3 + thumbnailHeightSpace + row * (thumbnailHeight + thumbnailHeightSpace);
+        return Region(x - 3, y - 3, x + thumbnailWidth + 3, y + thumbnailHeight + 3);
+    }
+
+    /* The dirty parts of the screen. The text regions need the font height. */
+    vector<Region> dirtyRegions(ALLEGRO_DISPLAY * display, int lineHeight) const {
+        int width = al_get_display_width(display);
+        int height = al_get_display_height(display);
+        int top = height / 3;
+
+        vector<Region> out;
+        if (dirtyAll){
+            out.push_back(Region(0, 0, width, height));
+            return out;
+        }
+
+        if (dirtyTop){
+            /* Include the line under the top pane */
+            out.push_back(Region(0, 0, width, top + 2));
+        } else if (dirtyText){
+            out.push_back(Region(0, 0, width, lineHeight * 2 + 3));
+        }
+
+        for (int index: dirtyImages){
+            out.push_back(imageRegion(display, index));
+        }
+
+        return out;
+    }
+
+    /* The screen is drawn into the canvas and only the dirty parts of it are
+     * drawn again, the whole canvas is then copied to the display.
+     */
+    ALLEGRO_BITMAP * getCanvas(ALLEGRO_DISPLAY * display){
+        int width = al_get_display_width(display);
+        int height = al_get_display_height(display);
+        if (canvas != nullptr &&
+            (al_get_bitmap_width(canvas) != width || al_get_bitmap_height(canvas) != height)){
+            al_destroy_bitmap(canvas);
+            canvas = nullptr;
+        }
+
+        if (canvas == nullptr){
+            al_set_new_bitmap_flags(ALLEGRO_VIDEO_BITMAP);
+            canvas = al_create_bitmap(width, height);
+            al_set_new_bitmap_flags(ALLEGRO_CONVERT_BITMAP);
+            invalidate();
+        }
+
+        return canvas;
     }
 
     int thumbnailsRow(ALLEGRO_DISPLAY * display) const {
@@ -480,7 +423,9 @@ public:
     void largerThumbnails(ALLEGRO_DISPLAY * display){
         thumbnailWidth += 5;
         thumbnailHeight += 5;
+        updateLevel();
         updateScroll(display);
+        invalidate();
     }
 
     void smallerThumbnails(ALLEGRO_DISPLAY * display){
@@ -493,10 +438,108 @@ public:
             thumbnailHeight = 5;
         }
 
+        updateLevel();
         updateScroll(display);
+        invalidate();
+    }
+
+    /* Switches to the thumbnail level for the current grid size. The atlas
+     * cells change size so every visible thumbnail is uploaded again.
+     */
+    void updateLevel(){
+        int wanted = levelFor(std::max(thumbnailWidth, thumbnailHeight));
+        if (wanted != level){
+            level = wanted;
+            atlas.setCellSize(level);
+        }
+    }
+
+    /* Index of the image in the sorted list or -1 */
+    int indexOf(Image * image) const {
+        auto found = std::lower_bound(images.begin(), images.end(), image, sortImage);
+        if (found != images.end() && *found == image){
+            return found - images.begin();
+        }
+        return -1;
+    }
+
+    void releaseLevel(Image * image){
+        if (image->level != nullptr){
+            al_destroy_bitmap(image->level);
+            image->level = nullptr;
+        }
+        image->levelSize = 0;
+    }
+
+    /* ThumbnailLevels finished a level */
+    void addLevel(LevelResult * result, ALLEGRO_DISPLAY * display){
+        Image * image = result->image;
+        int index = indexOf(image);
+        if (result->size != level || index == -1 || image->levelSize == level){
+            if (result->bitmap != nullptr){
+                al_destroy_bitmap(result->bitmap);
+            }
+            return;
+        }
+
+        /* If it failed the size is still set so its not asked for again, the
+         * normal thumbnail is used instead.
+         */
+        image->level = result->bitmap;
+        image->levelSize = result->size;
+        levelled.push_back(image);
+
+        if (index >= scroll && index < scroll + maxThumbnails(display)){
+            atlas.remove(image);
+            invalidateImage(display, index);
+        }
+    }
+
+    /* Lets go of levels that aren't the current one or are far from the screen,
+     * and asks for the current level of the visible thumbnails.
+     */
+    void updateLevels(ALLEGRO_DISPLAY * display){
+        int visible = maxThumbnails(display);
+        int keepFirst = scroll - visible;
+        int keepLast = scroll + visible * 2;
+        for (unsigned int i = 0; i < levelled.size(); /**/){
+            Image * image = levelled[i];
+            int index = indexOf(image);
+            if (image->levelSize != level || index < keepFirst || index >= keepLast){
+                releaseLevel(image);
+                levelled[i] = levelled.back();
+                levelled.pop_back();
+            } else {
+                i += 1;
+            }
+        }
+
+        vector<ThumbnailLevels::Request> wanted;
+        vector<Image*> requested;
+        if (level > THUMBNAIL_SIZE){
+            int last = std::min(scroll + visible, (int) images.size());
+            for (int i = scroll; i < last; i++){
+                Image * image = images[i];
+                if (image->levelSize != level && !image->pending()){
+                    ThumbnailLevels::Request request;
+                    request.image = image;
+                    request.file = image->filename;
+                    request.size = level;
+                    wanted.push_back(request);
+                    requested.push_back(image);
+                }
+            }
+        }
+
+        if (requested != lastRequested || level != lastRequestedLevel){
+            levels.request(wanted);
+            lastRequested = requested;
+            lastRequestedLevel = level;
+        }
     }
 
     void move(ALLEGRO_DISPLAY * display, int much){
+        invalidateImage(display, show);
         if (images.size() > 0){
             show += much;
             if (show < 0){
@@ -508,6 +551,38 @@ public:
         }
 
         updateScroll(display);
+        invalidateImage(display, show);
+        invalidateTop();
+        prefetch(much < 0 ? -1 : 1);
+    }
+
+    /* Number of images to load ahead of the current one in the direction the
+     * user is moving, and behind it in case they turn around.
+     */
+    static const int PREFETCH_AHEAD = 3;
+    static const int PREFETCH_BEHIND = 1;
+
+    void prefetch(int direction){
+        Image * current = currentImage();
+        if (current == nullptr){
+            return;
+        }
+
+        vector<string> files;
+        for (int i = 1; i <= PREFETCH_AHEAD; i++){
+            int index = show + i * direction;
+            if (index >= 0 && index < (signed) images.size()){
+                files.push_back(images[index]->filename);
+            }
+        }
+        for (int i = 1; i <= PREFETCH_BEHIND; i++){
+            int index = show - i * direction;
+            if (index >= 0 && index < (signed) images.size()){
+                files.push_back(images[index]->filename);
+            }
+        }
+
+        manager.prefetch(current->filename, files);
     }
 
     void moveLeft(ALLEGRO_DISPLAY * display){
@@ -534,16 +609,301 @@ public:
         move(display, maxThumbnails(display));
     }
 
-    /* Returns true if the image is in the current viewable set of images and
-     * thus needs to redraw the screen.
+    /* The thumbnails are made by the FileQueue's workers */
+    void setQueue(FileQueue * queue){
+        this->queue = queue;
+    }
+
+    /* The scan found more files. They are shown as empty cells until their
+     * thumbnail arrives so the user can already move to them, and the ones
+     * on screen are thumbnailed first.
+     *
+     * The files wait in arriving until the next frame, see mergeFound. Returns
+     * true since the screen needs to be drawn to show them.
+     */
+    bool addFiles(const FoundFiles & files, ALLEGRO_DISPLAY * display){
+        if (files.names.size() == 0){
+            return isDirty();
+        }
+
+        for (unsigned int i = 0; i < files.names.size(); i++){
+            int index = files.first + i;
+            Image * image = new Image(nullptr, arena.addName(files.names[i]), index);
+            if (index >= (int) found.size()){
+                found.resize(index + 1, nullptr);
+            }
+            found[index] = image;
+            arriving.push_back(image);
+        }
+
+        return true;
+    }
+
+    /* Merges the files that arrived since the last frame into the list, called
+     * before drawing. Files arrive in any order and a batch that sorts near the
+     * front moves every image after it, so this is done at most once per frame
+     * however many batches the scan sent in the meantime.
+     *
+     * The selected image and the images on screen stay the same unless new
+     * images land between them.
+     */
+    void mergeFound(ALLEGRO_DISPLAY * display){
+        if (arriving.size() == 0){
+            return;
+        }
+
+        vector<Image*> more;
+        more.swap(arriving);
+        std::sort(more.begin(), more.end(), sortImage);
+
+        bool first = images.size() == 0;
+        Image * oldShow = currentImage();
+        Image * oldScroll = scroll < (int) images.size() ? images[scroll] : nullptr;
+        int old = scroll;
+
+        /* Merged in place from the back, only the images that sort after the
+         * first new one are moved
+         */
+        int from = images.size() - 1;
+        int next = more.size() - 1;
+        images.resize(images.size() + more.size());
+        int to = images.size() - 1;
+        while (next >= 0){
+            if (from >= 0 && sortImage(more[next], images[from])){
+                images[to] = images[from];
+                from -= 1;
+            } else {
+                images[to] = more[next];
+                next -= 1;
+            }
+            to -= 1;
+        }
+
+        if (!first){
+            show = indexOf(oldShow);
+        }
+        if (oldScroll != nullptr){
+            scroll = indexOf(oldScroll);
+        }
+
+        /* If nothing landed on screen everything visible just moved over by
+         * however many files came before it.
+         */
+        int visible = maxThumbnails(display);
+        bool onScreen = false;
+        for (Image * image: more){
+            int index = indexOf(image);
+            if (index >= scroll && index < scroll + visible){
+                onScreen = true;
+                break;
+            }
+        }
+        if (onScreen){
+            invalidate();
+        } else {
+            for (int & dirty: dirtyImages){
+                dirty += scroll - old;
+            }
+        }
+
+        /* The image count changed */
+        invalidateText();
+        if (first){
+            invalidateTop();
+        }
+
+        prioritize(display);
+    }
+
+    /* A thumbnail worker finished the file with this index in the queue. If the
+     * file couldn't be thumbnailed it is taken out of the list.
+     */
+    bool setThumbnail(int queued, const Thumbnail * thumbnail, ALLEGRO_DISPLAY * display){
+        if (queued < 0 || queued >= (int) found.size() || found[queued] == nullptr){
+            return isDirty();
+        }
+
+        Image * image = found[queued];
+        int index = indexOf(image);
+        if (index == -1){
+            /* Not merged in yet, it shows up with the thumbnail on the next frame */
+            if (thumbnail != nullptr){
+                image->thumbnail = thumbnail;
+                stats.shownThumbnail();
+            } else {
+                auto waiting = std::find(arriving.begin(), arriving.end(), image);
+                if (waiting != arriving.end()){
+                    arriving.erase(waiting);
+                }
+            }
+            return isDirty();
+        }
+
+        if (thumbnail != nullptr){
+            image->thumbnail = thumbnail;
+            stats.shownThumbnail();
+            invalidateImage(display, index);
+            if (index == show){
+                /* Something to show until the picture is loaded */
+                invalidateTop();
+            }
+            trimThumbnails(display);
+            return isDirty();
+        }
+
+        /* ThumbnailLevels might still know about the image so it stays around
+         * until the view goes away.
+         */
+        atlas.remove(image);
+        images.erase(images.begin() + index);
+
+        if (index == show){
+            invalidateTop();
+        }
+        if (index < show || (show >= (int) images.size() && show > 0)){
+            show -= 1;
+        }
+
+        if (index < scroll){
+            /* Everything on screen moved back by one */
+            scroll -= 1;
+            for (int & dirty: dirtyImages){
+                dirty -= 1;
+            }
+        } else if (index < scroll + maxThumbnails(display)){
+            /* Everything after it moved back by one */
+            invalidate();
+        }
+
+        invalidateText();
+
+        return isDirty();
+    }
+
+    /* Tells the queue which files to thumbnail first. The visible page comes
+     * first, then the next page since that is where the user is most likely
+     * going, then the previous page. Everything else is done in the normal
+     * order after that.
+     */
+    void prioritize(ALLEGRO_DISPLAY * display){
+        if (queue == nullptr){
+            return;
+        }
+
+        int visible = maxThumbnails(display);
+        int size = images.size();
+        int end = std::min(scroll + visible, size);
+        vector<int> wanted;
+        for (int i = scroll; i < end; i++){
+            if (images[i]->pending()){
+                wanted.push_back(images[i]->queued);
+            }
+        }
+        for (int i = end; i < std::min(end + visible, size); i++){
+            if (images[i]->pending()){
+                wanted.push_back(images[i]->queued);
+            }
+        }
+        for (int i = scroll - 1; i >= std::max(0, scroll - visible); i--){
+            if (images[i]->pending()){
+                wanted.push_back(images[i]->queued);
+            }
+        }
+
+        if (wanted != lastPrioritized){
+            queue->prioritize(wanted);
+            lastPrioritized = wanted;
+        }
+    }
+
+    /* Thumbnails in memory are kept under this many bytes */
+    static const size_t DEFAULT_THUMBNAIL_BYTES = 512 * 1024 * 1024;
+
+    void setThumbnailBudget(size_t bytes){
+        thumbnailBudget = bytes;
+    }
+
+    /* Thumbnails near the screen are never evicted */
+    void keepRange(ALLEGRO_DISPLAY * display, int & first, int & last) const {
+        int visible = maxThumbnails(display);
+        first = std::max(0, scroll - visible);
+        last = std::min((int) images.size(), scroll + visible * 2);
+    }
+
+    bool restoreThumbnail(Image * image){
+        if (image->thumbnail == nullptr){
+            image->thumbnail = arena.restore(image->spill);
+        }
+        return image->thumbnail != nullptr;
+    }
+
+    /* Brings evicted thumbnails near the screen back, the visible page first so
+     * it is always complete, then the next page and then the previous one.
+     */
+    void restoreThumbnails(ALLEGRO_DISPLAY * display){
+        int visible = maxThumbnails(display);
+        int end = std::min(scroll + visible, (int) images.size());
+        for (int i = scroll; i < end; i++){
+            restoreThumbnail(images[i]);
+        }
+        for (int i = end; i < std::min(end + visible, (int) images.size()); i++){
+            restoreThumbnail(images[i]);
+        }
+        for (int i = scroll - 1; i >= std::max(0, scroll - visible); i--){
+            restoreThumbnail(images[i]);
+        }
+
+        trimThumbnails(display);
+    }
+
+    /* If the thumbnails take more memory than the budget, the ones farthest from
+     * the screen are evicted to the arena's spill file until they are a bit
+     * under it, so this doesn't run again for every new thumbnail.
      */
-    bool addImage(Image * image, ALLEGRO_DISPLAY * display){
-        images.push_back(image);
-        int size = images.size();
-        return size >= scroll && size < maxThumbnails(display);
+    void trimThumbnails(ALLEGRO_DISPLAY * display){
+        if (arena.resident() <= thumbnailBudget){
+            return;
+        }
+
+        size_t target = thumbnailBudget - thumbnailBudget / 20;
+        int first = 0;
+        int last = 0;
+        keepRange(display, first, last);
+
+        int low = 0;
+        int high = (int) images.size() - 1;
+        while (arena.resident() > target && (low < first || high >= last)){
+            Image * image = nullptr;
+            if (high >= last && (low >= first || high - scroll > scroll - low)){
+                image = images[high];
+                high -= 1;
+            } else {
+                image = images[low];
+                low += 1;
+            }
+
+            if (image->thumbnail != nullptr){
+                int64_t spill = arena.evict(image->thumbnail, image->spill);
+                if (spill < 0){
+                    /* Can't write the spill file so keep everything */
+                    return;
+                }
+                image->spill = spill;
+                image->thumbnail = nullptr;
+            }
+        }
+    }
+
+    void setPercent(int percent){
+        if (percent != this->percent){
+            this->percent = percent;
+            invalidateText();
+        }
     }
 
     void updateScroll(ALLEGRO_DISPLAY * display){
+        int old = scroll;
+
         while (show < scroll){
             scroll -= thumbnailsLine(display);
             if (scroll < 0){
@@ -562,6 +922,12 @@ public:
             }
         }
 
+        if (scroll != old){
+            invalidate();
+        }
+
+        prioritize(display);
+
         /*
         if (view.scroll < view.show - view.maxThumbnails(display) + view.thumbnailsLine(display)){
             view.scroll = view.show - view.maxThumbnails(display) + view.thumbnailsLine(display);
@@ -572,6 +938,13 @@ public:
         */
     }
     
+    /* Gives the image manager a slice of this frame to upload the current image */
+    void uploadImage(){
+        if (manager.upload()){
+            invalidateTop();
+        }
+    }
+
     ALLEGRO_BITMAP * getCurrentBitmap(){
         Image * current = currentImage();
         if (current != nullptr){
@@ -581,6 +954,50 @@ public:
         return nullptr;
     }
 
+    /* True if the current picture couldn't be loaded, call getCurrentBitmap first */
+    bool currentFailed(){
+        Image * current = currentImage();
+        return current != nullptr && manager.failed(current->filename);
+    }
+
+    /* Something to show in place of the current picture until its loaded, a
+     * reduced size decode from the image manager or else the thumbnail.
+     */
+    ALLEGRO_BITMAP * getCurrentPreview(){
+        Image * current = currentImage();
+        if (current == nullptr){
+            return nullptr;
+        }
+
+        ALLEGRO_BITMAP * decoded = manager.getPreview(current->filename);
+        if (decoded != nullptr){
+            return decoded;
+        }
+
+        if (current != previewImage && preview != nullptr){
+            al_destroy_bitmap(preview);
+            preview = nullptr;
+        }
+        previewImage = current;
+
+        if (preview == nullptr && !current->pending()){
+            /* Its drawn a lot bigger than it is so filter it */
+            int oldFlags = al_get_new_bitmap_flags();
+            al_set_new_bitmap_flags(ALLEGRO_VIDEO_BITMAP | ALLEGRO_MIN_LINEAR | ALLEGRO_MAG_LINEAR);
+            if (current->level != nullptr){
+                preview = al_clone_bitmap(current->level);
+            } else if (restoreThumbnail(current)){
+                preview = ThumbnailArena::bitmap(current->thumbnail);
+                if (preview != nullptr){
+                    al_convert_bitmap(preview);
+                }
+            }
+            al_set_new_bitmap_flags(oldFlags);
+        }
+
+        return preview;
+    }
+
     string getCurrentFilename() const {
         Image * current = currentImage();
         if (current != nullptr){
@@ -592,7 +1009,7 @@ public:
     /* set all bitmaps that aren't being shown to memory and set the bitmaps
      * that are visible to video
      */
-    void updateBitmaps(ALLEGRO_DISPLAY * display) const {
+    void updateBitmaps(ALLEGRO_DISPLAY * display){
         /*
         al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
         for (int i = 0; i < scroll; i++){
@@ -611,29 +1028,42 @@ public:
         }
         */
 
-        for (int i = 0; i < scroll; i++){
-            Image * image = images[i];
-            if (image->video != nullptr){
-                al_destroy_bitmap(image->video);
-                image->video = nullptr;
+        int last = std::min(scroll + maxThumbnails(display), (int) images.size());
+
+        restoreThumbnails(display);
+
+        /* Give back the cells of thumbnails that are not visible anymore. Only
+         * the atlas cells are looked at so this doesn't depend on how many
+         * images there are.
+         */
+        vector<bool> visible(atlas.size(), false);
+        for (int i = scroll; i < last; i++){
+            if (images[i]->slot != -1){
+                visible[images[i]->slot] = true;
             }
         }
-        for (int i = scroll + maxThumbnails(display); i < (signed) images.size(); i++){
-            Image * image = images[i];
-            if (image->video != nullptr){
-                al_destroy_bitmap(image->video);
-                image->video = nullptr;
+        for (int slot = 0; slot < atlas.size(); slot++){
+            Image * owner = atlas.owner(slot);
+            if (owner != nullptr && !visible[slot]){
+                atlas.remove(owner);
             }
         }
 
         /* Set the visible ones to video */
-        al_set_new_bitmap_flags(ALLEGRO_CONVERT_BITMAP);
-        for (int i = scroll; i < scroll + maxThumbnails(display) && i < (signed) images.size(); i++){
+        double start = al_get_time();
+        int uploaded = 0;
+        for (int i = scroll; i < last; i++){
             Image * image = images[i];
             if (image->video == nullptr){
-                image->video = al_clone_bitmap(image->thumbnail);
+                atlas.add(image);
+                uploaded += 1;
             }
         }
+        if (uploaded > 0){
+            stats.atlasUploaded((al_get_time() - start) * 1000, uploaded);
+        }
+
+        updateLevels(display);
 
         /* Reset the default */
         al_set_new_bitmap_flags(ALLEGRO_CONVERT_BITMAP);
@@ -671,150 +1101,57 @@ public:
     int percent;
 
     vector<Image*> images;
-
-    ImageManager manager;
-};
-
-static ALLEGRO_BITMAP * create_thumbnail(ALLEGRO_BITMAP * image){
-    double scale = 1;
-
-    /* Create thumbnails at 80x80. This is larger than the default
-     * thumbnail size that the user will see so it gives them a chance
-     * to increase the thumbnail size without messing up the images too much.
-     * Once the thumbnail size is increased beyond 80x80 (with +/-) it will
-     * start to look blocky.
+    /* Pixels of every thumbnail and the file names */
+    ThumbnailArena arena;
+    size_t thumbnailBudget;
+
+    /* Video copies of the visible thumbnails */
+    ThumbnailAtlas atlas;
+
+    /* The whole screen, only the dirty parts are drawn again */
+    ALLEGRO_BITMAP * canvas;
+    bool dirtyAll;
+    bool dirtyTop;
+    bool dirtyText;
+    /* Indexes of visible thumbnails that changed */
+    vector<int> dirtyImages;
+
+    /* Draw the statistics overlay */
+    bool showStats;
+
+    /* Size of the thumbnail level in use, one of LEVEL_SIZES */
+    int level;
+    ThumbnailLevels levels;
+    /* Images that have a level */
+    vector<Image*> levelled;
+    /* What levels was last asked to build */
+    vector<Image*> lastRequested;
+    int lastRequestedLevel;
+
+    /* The thumbnail of previewImage as a filtered video bitmap, see
+     * getCurrentPreview
      */
-    double scaleWidth = 80.0 / al_get_bitmap_width(image);
-    double scaleHeight = 80.0 / al_get_bitmap_height(image);
-
-    if (scaleHeight < scaleWidth){
-        scale = scaleHeight;
-    } else {
-        scale = scaleWidth;
-    }
-    ALLEGRO_BITMAP * thumbnail = al_create_bitmap(al_get_bitmap_width(image) * scale, al_get_bitmap_height(image) * scale);
-    al_set_target_bitmap(thumbnail);
-    al_clear_to_color(al_map_rgba_f(0, 0, 0, 0));
-    al_draw_scaled_bitmap(image,
-                          0, 0,
-                          al_get_bitmap_width(image),
-                          al_get_bitmap_height(image),
-                          0, 0,
-                          al_get_bitmap_width(thumbnail),
-                          al_get_bitmap_height(thumbnail),
-                          0);
-    return thumbnail;
-}
-
-static void loadFiles(const vector<string> & files, ALLEGRO_EVENT_SOURCE * events){
-    double percent = 0;
-    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
-    int count = 0;
-    for (const string & imageName: files){
-        count += 1;
-        al_lock_mutex(globalQuit);
-        if (doQuit){
-            al_unlock_mutex(globalQuit);
-            break;
-        }
-        al_unlock_mutex(globalQuit);
-
-        double now = (double)count / (double) files.size() * 100;
-        if (now - percent >= 1){
-            ALLEGRO_EVENT event;
-            event.user.type = PERCENT_TYPE;
-            event.user.data1 = (intptr_t) (int)now;
-            al_emit_user_event(events, &event, nullptr);
-            percent = now;
-        }
-
-        ALLEGRO_BITMAP * image = al_load_bitmap(imageName.c_str());
-        if (image != nullptr){
-            ALLEGRO_EVENT event;
-            event.user.type = VIEW_TYPE;
-            debug(" ..image %p\n", image);
-            ALLEGRO_BITMAP * thumbnail = create_thumbnail(image);
-            al_destroy_bitmap(image);
-            Image * store = new Image(thumbnail, imageName);
-            event.user.data1 = (intptr_t) store;
-            al_emit_user_event(events, &event, nullptr);
-        }
-    }
+    ALLEGRO_BITMAP * preview;
+    Image * previewImage;
 
-    /* Output 100% at the end */
-    {
-        ALLEGRO_EVENT event;
-        event.user.type = PERCENT_TYPE;
-        event.user.data1 = (intptr_t) 100;
-        al_emit_user_event(events, &event, nullptr);
-    }
-}
+    /* Where the files come from, and every file it found by queue index */
+    FileQueue * queue;
+    vector<Image*> found;
+    /* Found since the last frame, not in images yet */
+    vector<Image*> arriving;
+    /* What the queue was last asked to do first */
+    vector<int> lastPrioritized;
 
-struct LoadImagesStuff{
-    /* event source to send new images through */
-    ALLEGRO_EVENT_SOURCE * events;
-    /* true if doing a recursive search through the filesystem */
-    bool recursive;
-    /* starting directory */
-    string start;
+    ImageManager manager;
 };
 
-vector<string> getFiles(bool recursive, ALLEGRO_FS_ENTRY * here){
-    al_open_directory(here);
-    ALLEGRO_FS_ENTRY * file = al_read_directory(here);
-    vector<string> files;
-    while (file != nullptr){
-        al_lock_mutex(globalQuit);
-        if (doQuit){
-            al_unlock_mutex(globalQuit);
-            break;
-        }
-        al_unlock_mutex(globalQuit);
-
-        debug("Entry %s\n", al_get_fs_entry_name(file));
-        bool directory = al_get_fs_entry_mode(file) & ALLEGRO_FILEMODE_ISDIR;
-        if (directory && recursive){
-            vector<string> more = getFiles(recursive, file);
-            files.insert(files.end(), more.begin(), more.end());
-        } else {
-            files.push_back(al_get_fs_entry_name(file));
-        }
-        al_destroy_fs_entry(file);
-        file = al_read_directory(here);
-    }
-    al_close_directory(here);
-
-    return files;
-}
-
-void * loadImages(ALLEGRO_THREAD * self, void * data){
-    LoadImagesStuff * stuff = (LoadImagesStuff*) data;
-    ALLEGRO_EVENT_SOURCE * events = stuff->events;
-    bool recursive = stuff->recursive;
-
-    ALLEGRO_FS_ENTRY * here = al_create_fs_entry(stuff->start.c_str());
-    if (!al_fs_entry_exists(here)){
-        std::cout << "Directory '" << stuff->start << "' does not exist" << std::endl;
-        return nullptr;
-    }
-    std::cout << "Searching in '" << stuff->start << "'" << std::endl;
-    vector<string> files = getFiles(recursive, here);
-    al_destroy_fs_entry(here);
-
-    std::sort(files.begin(), files.end());
-    loadFiles(files, events);
-
-    return nullptr;
-}
-
-static void redraw(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, View & view){
-    al_clear_to_color(al_map_rgb(0, 0, 0));
-
+/* Draws the top part of the screen, the current image with its name and size
+ * and the counters above it.
+ */
+static void drawTop(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, View & view){
     double top = al_get_display_height(display) / 3.0;
     al_draw_line(0, top, al_get_display_width(display), top, al_map_rgb_f(1, 1, 1), 1);
 
-    view.updateBitmaps(display);
-
     if ((signed) view.images.size() > view.show){
         std::ostringstream number;
         number << "Image " << (view.show + 1) << " / " << view.images.size();
@@ -822,11 +1159,19 @@ static void redraw(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, View & view){
         // double widthRatio = (double) al_get_display_width(display) / al_get_bitmap_width(image->image);
         // double heightRatio = (double) al_get_display_height(display) / al_get_bitmap_height(image->image);
         
-        if (view.getCurrentBitmap() != nullptr){
-            ALLEGRO_BITMAP * image = view.getCurrentBitmap();
+        /* Until the picture is loaded a smaller version of it is stretched
+         * over the same area, the size is only known once its loaded.
+         */
+        ALLEGRO_BITMAP * image = view.getCurrentBitmap();
+        if (image != nullptr){
             number.str("");
             number << al_get_bitmap_width(image) << " x " << al_get_bitmap_height(image);
             al_draw_text(font, al_map_rgb_f(1, 1, 1), 1, 1 + al_get_font_line_height(font) + 1, ALLEGRO_ALIGN_LEFT, number.str().c_str());
+        } else {
+            image = view.getCurrentPreview();
+        }
+
+        if (image != nullptr){
             int px = al_get_display_width(display) / 2 - al_get_bitmap_width(image) / 2;
             int py = top / 2 - al_get_bitmap_height(image) / 2;
             int pw = al_get_bitmap_width(image);
@@ -861,20 +1206,56 @@ static void redraw(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, View & view){
         number << "Searching " << view.percent << "%";
         al_draw_text(font, al_map_rgb_f(1, 1, 1), al_get_display_width(display) - 1, 1, ALLEGRO_ALIGN_RIGHT, number.str().c_str());
     }
+}
 
-    int x = 1;
-    int y = top + view.thumbnailHeightSpace;
+/* Draws the thumbnails that are visible and inside the clip region. Only the
+ * visible range of images is looked at so the cost doesn't depend on how many
+ * images there are.
+ */
+static void drawThumbnails(ALLEGRO_DISPLAY * display, View & view, const Region & clip){
+    int last = std::min(view.scroll + view.maxThumbnails(display), (int) view.images.size());
+
+    /* The thumbnails are mostly in the same atlas page so hold the drawing to
+     * let allegro batch them. Primitives can't be drawn while the drawing is
+     * held so the selection and the empty cells of files that have no thumbnail
+     * yet are drawn afterwards.
+     */
+    vector<Region> empty;
+    bool selected = false;
+    int selectX1 = 0, selectY1 = 0, selectX2 = 0, selectY2 = 0;
+    al_hold_bitmap_drawing(true);
 
-    int count = view.scroll;
+    for (int index = view.scroll; index < last; index++){
+        Region region = view.imageRegion(display, index);
+        if (!region.intersects(clip)){
+            continue;
+        }
 
-    for (Image * store: vector<Image*>(view.images.begin() + view.scroll, view.images.end())){
-        count += 1;
+        Image * store = view.images[index];
         ALLEGRO_BITMAP * image = store->video;
 
+        if (store->pending()){
+            int px = region.x1 + 3;
+            int py = region.y1 + 3;
+            empty.push_back(Region(px, py, px + view.thumbnailWidth, py + view.thumbnailHeight));
+            if (index == view.show){
+                selected = true;
+                selectX1 = px - 2;
+                selectY1 = py - 2;
+                selectX2 = px + view.thumbnailWidth + 2;
+                selectY2 = py + view.thumbnailHeight + 2;
+            }
+            continue;
+        }
+
         if (image == nullptr){
             /* This should never really happen but its a failsafe */
-            store->video = al_clone_bitmap(store->thumbnail);
+            view.atlas.add(store);
             image = store->video;
+            if (image == nullptr){
+                /* Out of video memory, there is no other copy to draw */
+                continue;
+            }
 
             /*
             printf("Video thumbnail image should not be null!\n");
@@ -882,11 +1263,6 @@ static void redraw(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, View & view){
             */
         }
 
-        int px = x;
-        int py = y;
-        int pw = al_get_bitmap_width(image);
-        int ph = al_get_bitmap_height(image);
-
         double expandHeight = (double) view.thumbnailHeight / al_get_bitmap_height(image);
         double expandWidth = (double) view.thumbnailWidth / al_get_bitmap_width(image);
 
@@ -896,34 +1272,94 @@ static void redraw(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, View & view){
         } else {
             expand = expandWidth;
         }
-        int newWidth = al_get_bitmap_width(image) * expand;
-        int newHeight = al_get_bitmap_height(image) * expand;
 
-        px = x;
-        py = y;
-        pw = newWidth;
-        ph = newHeight;
+        /* The region has room for the selection around the thumbnail */
+        int px = region.x1 + 3;
+        int py = region.y1 + 3;
+        int pw = al_get_bitmap_width(image) * expand;
+        int ph = al_get_bitmap_height(image) * expand;
 
         debug("thumbnail at %d, %d %d, %d\n", px, py, pw, ph);
         al_draw_scaled_bitmap(image,
                               0, 0, al_get_bitmap_width(image), al_get_bitmap_height(image),
                               px, py, pw, ph, 0);
 
-        if (count == view.show){
-            al_draw_rectangle(px - 2, py - 2, px + pw + 2, py + ph + 2, al_map_rgb_f(1, 0, 0), 2);
+        if (index == view.show){
+            selected = true;
+            selectX1 = px - 2;
+            selectY1 = py - 2;
+            selectX2 = px + pw + 2;
+            selectY2 = py + ph + 2;
         }
+    }
 
-        x += view.thumbnailWidth + view.thumbnailWidthSpace;
-        if (x + view.thumbnailWidth >= al_get_display_width(display)){
-            x = 1;
-            y += view.thumbnailHeight + view.thumbnailHeightSpace;
-        }
+    al_hold_bitmap_drawing(false);
+
+    for (const Region & cell: empty){
+        al_draw_rectangle(cell.x1 + 0.5, cell.y1 + 0.5, cell.x2 - 0.5, cell.y2 - 0.5, al_map_rgb_f(0.3, 0.3, 0.3), 1);
+    }
+
+    if (selected){
+        al_draw_rectangle(selectX1, selectY1, selectX2, selectY2, al_map_rgb_f(1, 0, 0), 2);
+    }
+}
+
+/* Draws the statistics on top of everything. This goes straight to the
+ * backbuffer so the canvas never has to be cleaned up when it goes away.
+ */
+static void drawStats(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font){
+    vector<string> lines = stats.describe();
+    int height = al_get_font_line_height(font);
+    int width = 0;
+    for (const string & line: lines){
+        width = std::max(width, al_get_text_width(font, line.c_str()));
+    }
+
+    int x = 5;
+    int y = height * 2 + 8;
+    al_draw_filled_rectangle(x, y, x + width + 8, y + height * lines.size() + 8, al_map_rgba(0, 0, 0, 200));
+    for (const string & line: lines){
+        al_draw_text(font, al_map_rgb_f(0.6, 1, 0.6), x + 4, y + 4, 0, line.c_str());
+        y += height;
+    }
+}
+
+/* Draws the dirty parts of the screen into the view's canvas and then puts the
+ * canvas on the display.
+ */
+static void redraw(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, View & view){
+    double start = al_get_time();
+    ALLEGRO_BITMAP * canvas = view.getCanvas(display);
 
-        if (y + view.thumbnailHeight >= al_get_display_height(display)){
-            debug("break height\n");
-            break;
+    view.mergeFound(display);
+    view.updateBitmaps(display);
+    view.uploadImage();
+
+    int top = al_get_display_height(display) / 3;
+    vector<Region> regions = view.dirtyRegions(display, al_get_font_line_height(font));
+    if (regions.size() > 0){
+        al_set_target_bitmap(canvas);
+        for (const Region & region: regions){
+            debug("redraw %d, %d - %d, %d\n", region.x1, region.y1, region.x2, region.y2);
+            al_set_clipping_rectangle(region.x1, region.y1, region.x2 - region.x1, region.y2 - region.y1);
+            al_clear_to_color(al_map_rgb(0, 0, 0));
+            if (region.y1 <= top + 1){
+                drawTop(display, font, view);
+            }
+            drawThumbnails(display, view, region);
         }
+        al_reset_clipping_rectangle();
+    }
+    view.clean();
+
+    al_set_target_backbuffer(display);
+    al_draw_bitmap(canvas, 0, 0, 0);
+
+    if (view.showStats){
+        drawStats(display, font);
     }
+
+    stats.frame((al_get_time() - start) * 1000);
 }
 
 /* Get the font from the directory where the executable lives */
@@ -946,16 +1382,17 @@ struct Position{
     int endX2, endY2;
 };
 
-Position computePosition(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, ALLEGRO_BITMAP * image){
+/* Where the picture starts and ends when its zoomed to the center. width and
+ * height are the size of the picture. Pictures smaller than the screen are shown
+ * at their own size unless grow is set, for when the size isn't known yet.
+ */
+Position computePosition(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, int width, int height, bool grow){
     Position position;
 
-    int pw = al_get_bitmap_width(image);
-    int ph = al_get_bitmap_height(image);
-
     double top = al_get_display_height(display) / 3.0;
 
-    double expandHeight = (top - al_get_font_line_height(font) - 10) / (double) al_get_bitmap_height(image);
-    double expandWidth = (al_get_display_width(display) - 10) / (double) al_get_bitmap_width(image);
+    double expandHeight = (top - al_get_font_line_height(font) - 10) / (double) height;
+    double expandWidth = (al_get_display_width(display) - 10) / (double) width;
 
     double expand = 1;
     if (expandHeight < expandWidth){
@@ -963,33 +1400,33 @@ Position computePosition(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, ALLEGRO
     } else {
         expand = expandWidth;
     }
-    int newWidth = al_get_bitmap_width(image) * expand;
-    int newHeight = al_get_bitmap_height(image) * expand;
+    int newWidth = width * expand;
+    int newHeight = height * expand;
 
     int px = al_get_display_width(display) / 2 - newWidth / 2;
     int py = (top - al_get_font_line_height(font)) / 2 - newHeight / 2;
-    pw = newWidth;
-    ph = newHeight;
+    int pw = newWidth;
+    int ph = newHeight;
 
     position.startX1 = px;
     position.startY1 = py;
     position.startX2 = px + pw;
     position.startY2 = py + ph;
 
-    expandWidth = (double) (al_get_display_width(display) - 10) / al_get_bitmap_width(image);
-    expandHeight = (double) (al_get_display_height(display) - 10) / al_get_bitmap_height(image);
+    expandWidth = (double) (al_get_display_width(display) - 10) / width;
+    expandHeight = (double) (al_get_display_height(display) - 10) / height;
 
-    newWidth = al_get_bitmap_width(image);
-    newHeight = al_get_bitmap_height(image);
-    if (expandWidth < 1 || expandHeight < 1){
+    newWidth = width;
+    newHeight = height;
+    if (grow || expandWidth < 1 || expandHeight < 1){
         double expand = 1;
         if (expandHeight < expandWidth){
             expand = expandHeight;
         } else {
             expand = expandWidth;
         }
-        newWidth = al_get_bitmap_width(image) * expand;
-        newHeight = al_get_bitmap_height(image) * expand;
+        newWidth = width * expand;
+        newHeight = height * expand;
     }
 
     position.endX1 = al_get_display_width(display) / 2 - newWidth / 2;
@@ -999,7 +1436,6 @@ Position computePosition(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, ALLEGRO
 
     return position;
 }
-                                    
 void drawCenter(ALLEGRO_DISPLAY * display, ALLEGRO_BITMAP * image, const Position & position, int steps, int much){
 
     /* Darken rest of the screen */
@@ -1018,6 +1454,374 @@ void drawCenter(ALLEGRO_DISPLAY * display, ALLEGRO_BITMAP * image, const Positio
 
 }
 
+/* How the centered picture is zoomed. x and y are the point of the picture in
+ * the middle of the screen, in pixels of the full size picture.
+ */
+struct Zoom{
+    double scale;
+    double x, y;
+};
+
+/* Screen pixels per pixel of the picture when it just fits, like drawCenter */
+static double fitScale(ALLEGRO_DISPLAY * display, ALLEGRO_BITMAP * image, int width){
+    double expandWidth = (double) (al_get_display_width(display) - 10) / al_get_bitmap_width(image);
+    double expandHeight = (double) (al_get_display_height(display) - 10) / al_get_bitmap_height(image);
+    double expand = std::min(1.0, std::min(expandWidth, expandHeight));
+    return expand * al_get_bitmap_width(image) / width;
+}
+
+static Zoom resetZoom(int width, int height){
+    Zoom zoom;
+    zoom.scale = 1;
+    zoom.x = width / 2.0;
+    zoom.y = height / 2.0;
+    return zoom;
+}
+
+/* Draws the centered picture zoomed in. tiled is used for the parts of huge
+ * pictures that need more pixels than the bitmap has.
+ */
+void drawZoomed(ALLEGRO_DISPLAY * display, ALLEGRO_BITMAP * image, TiledImage * tiled, const Zoom & zoom){
+    al_set_blender(ALLEGRO_ADD, ALLEGRO_ALPHA, ALLEGRO_INVERSE_ALPHA);
+    al_draw_filled_rectangle(0, 0, al_get_display_width(display), al_get_display_height(display), al_map_rgba_f(0, 0, 0, 0.8));
+    al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO);
+
+    int width = tiled != nullptr ? tiled->getWidth() : al_get_bitmap_width(image);
+    int height = tiled != nullptr ? tiled->getHeight() : al_get_bitmap_height(image);
+    double scale = fitScale(display, image, width) * zoom.scale;
+    double x = al_get_display_width(display) / 2 - zoom.x * scale;
+    double y = al_get_display_height(display) / 2 - zoom.y * scale;
+
+    if (tiled != nullptr){
+        tiled->draw(image, x, y, scale, al_get_display_width(display), al_get_display_height(display));
+    } else {
+        al_draw_scaled_bitmap(image, 0, 0, al_get_bitmap_width(image), al_get_bitmap_height(image),
+                              x, y, width * scale, height * scale, 0);
+    }
+}
+
+/* Handles a TILE_TYPE event. Returns true if the picture should be redrawn. */
+static bool handleTile(const ALLEGRO_EVENT & event, TiledImage * tiled){
+    TileResult * result = (TileResult*) event.user.data1;
+    if (tiled == nullptr || tiled->getId() != (int) event.user.data2){
+        /* From a picture that isn't shown anymore */
+        if (result != nullptr){
+            al_destroy_bitmap(result->bitmap);
+            delete result;
+        }
+        return false;
+    }
+
+    if (result == nullptr){
+        tiled->built();
+        return true;
+    }
+
+    tiled->addTile(result);
+    delete result;
+    return true;
+}
+
+/* Handles the events of the scan and the thumbnail threads, which have to be
+ * handled whatever the screen shows. Returns false if it isn't one of them.
+ */
+static bool pipelineEvent(const ALLEGRO_EVENT & event, View & view, ALLEGRO_DISPLAY * display, bool & draw){
+    if (event.type == FOUND_TYPE){
+        FoundFiles * found = (FoundFiles*) event.user.data1;
+        draw = view.addFiles(*found, display) || draw;
+        delete found;
+    } else if (event.type == VIEW_TYPE){
+        ThumbnailResults * results = (ThumbnailResults*) event.user.data1;
+        vector<ThumbnailResult> taken = results->take();
+        debug("Got %d thumbnails\n", (int) taken.size());
+        for (const ThumbnailResult & result: taken){
+            draw = view.setThumbnail(result.index, result.thumbnail, display) || draw;
+        }
+    } else if (event.type == PERCENT_TYPE){
+        int percent = (int) event.user.data1;
+        view.setPercent(percent);
+        draw = view.isDirty() || draw;
+    } else if (event.type == LEVEL_TYPE){
+        LevelResult * result = (LevelResult*) event.user.data1;
+        view.addLevel(result, display);
+        delete result;
+        draw = view.isDirty() || draw;
+    } else if (event.type == TILE_TYPE){
+        /* Left over from a picture that was zoomed into */
+        handleTile(event, nullptr);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Seconds to wait for a picture before saying its taking long */
+static const double LOAD_TIMEOUT = 10;
+
+/* The picture zoomed to the center of the screen. Until its loaded the preview
+ * from the image manager or the thumbnail is shown in its place.
+ */
+struct Centered{
+    Centered(const string & file, ALLEGRO_EVENT_SOURCE * events):
+    file(file),
+    events(events),
+    bitmap(nullptr),
+    loaded(false),
+    failed(false),
+    tiled(nullptr),
+    width(0),
+    height(0),
+    start(al_get_time()){
+        /* Only the header is read, so the animation ends at the right size */
+        known = jpegSize(file, width, height);
+        zoom = resetZoom(width, height);
+    }
+
+    ~Centered(){
+        delete tiled;
+    }
+
+    /* Gets the bitmap to draw again, the view can replace or destroy previews
+     * when it redraws. Call after redraw.
+     */
+    void update(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, View & view){
+        ALLEGRO_BITMAP * full = view.getCurrentBitmap();
+        if (full != nullptr){
+            if (!loaded){
+                loaded = true;
+                if (known && isHuge(width, height)){
+                    /* The bitmap of a huge jpeg is scaled down, zooming in
+                     * reads the rest from tiles.
+                     */
+                    tiled = new TiledImage(file, width, height, events);
+                } else {
+                    width = al_get_bitmap_width(full);
+                    height = al_get_bitmap_height(full);
+                }
+                known = true;
+                zoom = resetZoom(width, height);
+            }
+            bitmap = full;
+        } else {
+            failed = view.currentFailed();
+            bitmap = view.getCurrentPreview();
+        }
+
+        if (bitmap != nullptr){
+            if (tiled != nullptr){
+                position = computePosition(display, font, al_get_bitmap_width(bitmap), al_get_bitmap_height(bitmap), false);
+            } else if (known){
+                position = computePosition(display, font, width, height, false);
+            } else {
+                position = computePosition(display, font, al_get_bitmap_width(bitmap), al_get_bitmap_height(bitmap), true);
+            }
+        }
+    }
+
+    bool timedOut() const {
+        return al_get_time() - start > LOAD_TIMEOUT;
+    }
+
+    void draw(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, int steps, int much, bool zoomed){
+        if (bitmap == nullptr){
+            al_set_blender(ALLEGRO_ADD, ALLEGRO_ALPHA, ALLEGRO_INVERSE_ALPHA);
+            al_draw_filled_rectangle(0, 0, al_get_display_width(display), al_get_display_height(display), al_map_rgba_f(0, 0, 0, 0.8));
+            al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO);
+        } else if (loaded && zoomed){
+            drawZoomed(display, bitmap, tiled, zoom);
+        } else {
+            drawCenter(display, bitmap, position, steps, much);
+        }
+
+        const char * message = nullptr;
+        if (failed){
+            message = "Could not load this picture";
+        } else if (!loaded && timedOut()){
+            message = "Still loading";
+        } else if (bitmap == nullptr){
+            message = "Loading";
+        }
+        if (message != nullptr){
+            al_draw_text(font, al_map_rgb_f(1, 1, 1), al_get_display_width(display) / 2,
+                         al_get_display_height(display) - al_get_font_line_height(font) - 5,
+                         ALLEGRO_ALIGN_CENTRE, message);
+        }
+    }
+
+    /* Zoom keys, returns true if the picture moved */
+    bool key(ALLEGRO_DISPLAY * display, const ALLEGRO_KEYBOARD_EVENT & keyboard){
+        if (!loaded){
+            return false;
+        }
+
+        /* Arrows move a quarter of the screen */
+        double scale = fitScale(display, bitmap, width) * zoom.scale;
+        bool moved = true;
+        switch (keyboard.keycode){
+            case ALLEGRO_KEY_LEFT: {
+                zoom.x -= al_get_display_width(display) / 4.0 / scale;
+                break;
+            }
+            case ALLEGRO_KEY_RIGHT: {
+                zoom.x += al_get_display_width(display) / 4.0 / scale;
+                break;
+            }
+            case ALLEGRO_KEY_UP: {
+                zoom.y -= al_get_display_height(display) / 4.0 / scale;
+                break;
+            }
+            case ALLEGRO_KEY_DOWN: {
+                zoom.y += al_get_display_height(display) / 4.0 / scale;
+                break;
+            }
+            default: {
+                moved = false;
+            }
+        }
+        switch (keyboard.unichar){
+            case '=': {
+                /* Up to 4 screen pixels per pixel of the picture */
+                zoom.scale = std::min(zoom.scale * 1.5, 4 / fitScale(display, bitmap, width));
+                moved = true;
+                break;
+            }
+            case '-': {
+                zoom.scale = std::max(zoom.scale / 1.5, 1.0);
+                moved = true;
+                break;
+            }
+            case '0': {
+                zoom = resetZoom(width, height);
+                moved = true;
+                break;
+            }
+        }
+        zoom.x = std::max(0.0, std::min(zoom.x, (double) width));
+        zoom.y = std::max(0.0, std::min(zoom.y, (double) height));
+        return moved;
+    }
+
+    const string file;
+    ALLEGRO_EVENT_SOURCE * events;
+    /* What is drawn, owned by the view */
+    ALLEGRO_BITMAP * bitmap;
+    bool loaded;
+    bool failed;
+    TiledImage * tiled;
+    /* Size of the picture, if known is set */
+    int width;
+    int height;
+    bool known;
+    double start;
+    Position position;
+    Zoom zoom;
+};
+
+/* Shows an animation of the current image being interpolated to its position
+ * at the center of the screen, waits for enter and animates it back. It starts
+ * right away from the thumbnail, the picture is swapped in when it is loaded.
+ * Returns false if the program should quit.
+ */
+static bool showCurrent(ALLEGRO_DISPLAY * display, ALLEGRO_FONT * font, View & view, ALLEGRO_EVENT_QUEUE * queue, ALLEGRO_EVENT_SOURCE * imageSource){
+    Image * image = view.currentImage();
+    if (image == nullptr){
+        return true;
+    }
+
+    enum Phase{
+        ZoomIn,
+        Showing,
+        ZoomOut
+    };
+
+    Centered center(image->filename, imageSource);
+
+    ALLEGRO_TIMER * timer = al_create_timer(0.02);
+    al_start_timer(timer);
+    al_register_event_source(queue, al_get_timer_event_source(timer));
+    const int steps = 12;
+    int much = 0;
+    Phase phase = ZoomIn;
+    bool quit = false;
+    bool warned = false;
+
+    redraw(display, font, view);
+    center.update(display, font, view);
+    center.draw(display, font, steps, much, false);
+    al_flip_display();
+
+    bool done = false;
+    while (!done){
+        ALLEGRO_EVENT event;
+        bool draw = false;
+        al_wait_for_event(queue, &event);
+        stats.eventReceived(event);
+        if (event.type == ALLEGRO_EVENT_KEY_CHAR){
+            if (event.keyboard.keycode == ALLEGRO_KEY_ESCAPE){
+                quit = true;
+                break;
+            } else if (event.keyboard.keycode == ALLEGRO_KEY_ENTER){
+                if (phase == ZoomOut){
+                    done = true;
+                } else {
+                    phase = ZoomOut;
+                }
+            } else if (phase == Showing){
+                draw = center.key(display, event.keyboard);
+            }
+        } else if (event.type == ALLEGRO_EVENT_TIMER && event.timer.source == timer){
+            if (phase == ZoomIn){
+                much += 1;
+                if (much == steps){
+                    phase = Showing;
+                }
+                draw = true;
+            } else if (phase == ZoomOut){
+                much -= 1;
+                if (much <= 0){
+                    done = true;
+                }
+                draw = true;
+            } else if (!center.loaded && !warned && center.timedOut()){
+                warned = true;
+                draw = true;
+            }
+        } else if (event.type == LOAD_TYPE){
+            /* A preview, the picture or a part of its upload */
+            view.invalidateTop();
+            draw = true;
+        } else if (event.type == TILE_TYPE){
+            draw = handleTile(event, center.tiled);
+        } else if (pipelineEvent(event, view, display, draw)){
+            /* The thumbnails behind are kept up to date */
+        } else if (event.type == ALLEGRO_EVENT_DISPLAY_EXPOSE){
+            view.invalidate();
+            draw = true;
+        } else if (event.type == ALLEGRO_EVENT_DISPLAY_RESIZE){
+            al_acknowledge_resize(event.display.source);
+            view.invalidate();
+            view.prioritize(display);
+            draw = true;
+        }
+
+        if (draw && !done){
+            redraw(display, font, view);
+            center.update(display, font, view);
+            center.draw(display, font, steps, much, phase == Showing);
+            al_flip_display();
+        }
+    }
+
+    al_stop_timer(timer);
+    al_destroy_timer(timer);
+
+    if (!quit){
+        redraw(display, font, view);
+        al_flip_display();
+    }
+    return !quit;
+}
+
 static int init(){
     if (!al_init()){
         std::cout << "Could not initialize allegro. Likely to do a version mismatch. Compiled with " << ALLEGRO_VERSION_INT << " but allegro reports " << al_get_allegro_version() << std::endl;
@@ -1059,6 +1863,8 @@ int main(int argc, char ** argv){
         return 1;
     }
 
+    stats.begin();
+
     al_set_new_display_flags(ALLEGRO_RESIZABLE | ALLEGRO_GENERATE_EXPOSE_EVENTS);
     ALLEGRO_DISPLAY * display = al_create_display(800, 700);
     ALLEGRO_EVENT_QUEUE * queue = al_create_event_queue();
@@ -1079,20 +1885,56 @@ int main(int argc, char ** argv){
 
     View view(&imageSource);
 
+    /* Refreshes the statistics overlay while its shown */
+    ALLEGRO_TIMER * statsTimer = al_create_timer(0.5);
+    al_register_event_source(queue, al_get_timer_event_source(statsTimer));
+    string statsFile;
+
+    /* Redraws happen at most once per refresh of the display. Whatever asks for
+     * a redraw sooner than that is drawn when frameTimer goes off.
+     */
+    double framePeriod = 1.0 / 60;
+    if (al_get_display_refresh_rate(display) > 0){
+        framePeriod = 1.0 / al_get_display_refresh_rate(display);
+    }
+    ALLEGRO_TIMER * frameTimer = al_create_timer(framePeriod);
+    al_register_event_source(queue, al_get_timer_event_source(frameTimer));
+    double lastFrame = 0;
+    bool late = false;
+
     debug("thumbs %d\n", view.maxThumbnails(display));
 
     redraw(display, font, view);
     al_flip_display();
 
+    /* Files the scan found, the view tells it which ones to thumbnail first */
+    FileQueue files;
+    ThumbnailResults results(&imageSource);
+    view.setQueue(&files);
+
     /* Ok to put on the stack since we are in main */
     LoadImagesStuff stuff;
     stuff.events = &imageSource;
     stuff.start = ".";
     stuff.recursive = false;
+    stuff.files = &files;
+    stuff.arena = &view.arena;
+    stuff.results = &results;
     for (int i = 1; i < argc; i++){
         string arg = argv[i];
         if (arg == "-r" || arg == "-R"){
             stuff.recursive = true;
+        } else if (arg == "--compact"){
+            view.arena.setCompact(true);
+        } else if (arg == "--thumbnail-memory" && i + 1 < argc){
+            i += 1;
+            view.setThumbnailBudget((size_t) atoi(argv[i]) * 1024 * 1024);
+        } else if (arg == "--cache" && i + 1 < argc){
+            i += 1;
+            view.manager.setCacheBudget((size_t) atoi(argv[i]) * 1024 * 1024);
+        } else if (arg == "--stats" && i + 1 < argc){
+            i += 1;
+            statsFile = argv[i];
         } else {
             stuff.start = arg;
         }
@@ -1105,6 +1947,7 @@ int main(int argc, char ** argv){
         bool draw = false;
         do{
             al_wait_for_event(queue, &event);
+            stats.eventReceived(event);
             if (event.type == ALLEGRO_EVENT_KEY_CHAR){
                 switch (event.keyboard.keycode){
                     case ALLEGRO_KEY_ESCAPE: {
@@ -1114,7 +1957,13 @@ int main(int argc, char ** argv){
                         al_lock_mutex(globalQuit);
                         doQuit = true;
                         al_unlock_mutex(globalQuit);
+                        results.stop();
                         al_join_thread(imageThread, nullptr);
+                        if (statsFile != "" && !stats.save(statsFile)){
+                            std::cout << "Could not write statistics to '" << statsFile << "'" << std::endl;
+                        }
+                        al_destroy_timer(statsTimer);
+                        al_destroy_timer(frameTimer);
                         al_destroy_user_event_source(&imageSource);
                         al_destroy_display(display);
                         debug("Quit\n");
@@ -1152,150 +2001,12 @@ int main(int argc, char ** argv){
                     }
                     
                     case ALLEGRO_KEY_ENTER: {
-
-                        /* Start a new loop that shows an animation of the current
-                         * image being interpolated to its position at the center
-                         * of the screen.
+                        /* Zoom the current image to the center of the screen
+                         * until enter is pressed again.
                          */
-
-                        Image * image = view.currentImage();
-                        if (image != nullptr){
-                            bool ok = true;
-                            bool wait = true;
-
-                            /* Wait for the main image to be loaded.
-                             *
-                             * FIXME: there is a non-zero chance the bitmap
-                             * can't be loaded so it will always be NULL. Instead
-                             * we can wait for a LOAD_TYPE event and if the bitmap
-                             * is still NULL after that then we should fail to show
-                             * it in the center.
-                             */
-                            while (view.getCurrentBitmap() == nullptr){
-                                al_rest(0.001);
-                            }
-
-                            ALLEGRO_BITMAP * bitmap = view.getCurrentBitmap();
-
-                            ALLEGRO_TIMER * timer = al_create_timer(0.02);
-                            al_start_timer(timer);
-                            al_register_event_source(queue, al_get_timer_event_source(timer));
-                            Position position = computePosition(display, font, bitmap);
-                            const int steps = 12;
-                            int much = 0;
-                            while (ok){
-                                bool draw = false;
-                                al_wait_for_event(queue, &event);
-                                if (event.type == ALLEGRO_EVENT_KEY_CHAR){
-                                    switch (event.keyboard.keycode){
-                                        case ALLEGRO_KEY_ESCAPE: {
-                                            goto quit_program;
-                                            break;
-                                        }
-                                        case ALLEGRO_KEY_ENTER: {
-                                            ok = false;
-                                            wait = false;
-                                            break;
-                                        }
-                                    }
-                                } else if (event.type == ALLEGRO_EVENT_DISPLAY_EXPOSE){
-                                    draw = true;
-                                } else if (event.type == ALLEGRO_EVENT_DISPLAY_RESIZE){
-                                    al_acknowledge_resize(event.display.source);
-                                    position = computePosition(display, font, bitmap);
-                                    draw = true;
-                                } else if (event.type == ALLEGRO_EVENT_TIMER){
-                                    much += 1;
-                                    if (much == steps){
-                                        ok = false;
-                                    }
-                                    draw = true;
-                                }
-
-                                if (draw){
-                                    redraw(display, font, view);
-                                    drawCenter(display, bitmap, position, steps, much);
-                                    al_flip_display();
-                                }
-                            }
-
-                            if (wait){
-                                /* Wait for key press */
-                                ok = true;
-                                while (ok){
-                                    al_wait_for_event(queue, &event);
-                                    bool draw = false;
-                                    if (event.type == ALLEGRO_EVENT_KEY_CHAR){
-                                        switch (event.keyboard.keycode){
-                                            case ALLEGRO_KEY_ESCAPE: {
-                                                goto quit_program;
-                                                break;
-                                            }
-                                            case ALLEGRO_KEY_ENTER: {
-                                                ok = false;
-                                                break;
-                                            }
-                                        }
-                                    } else if (event.type == ALLEGRO_EVENT_DISPLAY_EXPOSE){
-                                        draw = true;
-                                    } else if (event.type == ALLEGRO_EVENT_DISPLAY_RESIZE){
-                                        al_acknowledge_resize(event.display.source);
-                                        position = computePosition(display, font, bitmap);
-                                        draw = true;
-                                    }
-
-                                    if (draw){
-                                        redraw(display, font, view);
-                                        drawCenter(display, bitmap, position, steps, much);
-                                        al_flip_display();
-                                    }
-                                }
-                            }
-
-                            /* Uninterpolate the image */
-                            ok = true;
-                            while (ok){
-                                al_wait_for_event(queue, &event);
-                                bool draw = false;
-                                if (event.type == ALLEGRO_EVENT_KEY_CHAR){
-                                    switch (event.keyboard.keycode){
-                                        case ALLEGRO_KEY_ESCAPE: {
-                                            goto quit_program;
-                                            break;
-                                        }
-                                        case ALLEGRO_KEY_ENTER: {
-                                            ok = false;
-                                            break;
-                                        }
-                                    }
-                                } else if (event.type == ALLEGRO_EVENT_DISPLAY_EXPOSE){
-                                    draw = true;
-                                } else if (event.type == ALLEGRO_EVENT_TIMER){
-                                    much -= 1;
-                                    if (much == 0){
-                                        ok = false;
-                                    }
-                                    draw = true;
-                                } else if (event.type == ALLEGRO_EVENT_DISPLAY_RESIZE){
-                                    al_acknowledge_resize(event.display.source);
-                                    position = computePosition(display, font, bitmap);
-                                    draw = true;
-                                }
-
-                                if (draw){
-                                    redraw(display, font, view);
-                                    drawCenter(display, bitmap, position, steps, much);
-                                    al_flip_display();
-                                }
-                            }
-
-                            redraw(display, font, view);
-                            al_flip_display();
-
-                            al_stop_timer(timer);
-                            al_destroy_timer(timer);
+                        if (!showCurrent(display, font, view, queue, &imageSource)){
+                            goto quit_program;
                         }
-
                         break;
                     }
                     default: {
@@ -1350,28 +2061,49 @@ int main(int argc, char ** argv){
                         view.moveRight(display);
                         break;
                     }
+                    case 's': {
+                        view.showStats = !view.showStats;
+                        if (view.showStats){
+                            al_start_timer(statsTimer);
+                        } else {
+                            al_stop_timer(statsTimer);
+                        }
+                        draw = true;
+                        break;
+                    }
                 }
-            } else if (event.type == VIEW_TYPE){
-                debug("Got image %p\n", event.user.data1);
-                Image * image = (Image*) event.user.data1;
-                draw = view.addImage(image, display);
-            } else if (event.type == PERCENT_TYPE){
-                int percent = (int) event.user.data1;
-                view.percent = percent;
-                draw = true;
+            } else if (pipelineEvent(event, view, display, draw)){
+                /* Handled */
             } else if (event.type == LOAD_TYPE){
+                view.invalidateTop();
                 draw = true;
             } else if (event.type == ALLEGRO_EVENT_DISPLAY_RESIZE){
                 al_acknowledge_resize(event.display.source);
+                view.invalidate();
+                /* A different number of thumbnails fit now */
+                view.prioritize(display);
                 draw = true;
             } else if (event.type == ALLEGRO_EVENT_DISPLAY_EXPOSE){
+                view.invalidate();
+                draw = true;
+            } else if (event.type == ALLEGRO_EVENT_TIMER && event.timer.source == statsTimer){
+                draw = true;
+            } else if (event.type == ALLEGRO_EVENT_TIMER && event.timer.source == frameTimer){
+                al_stop_timer(frameTimer);
+                late = false;
                 draw = true;
             }
         } while (al_peek_next_event(queue, &event));
 
-        if (draw){
+        if (draw && al_get_time() - lastFrame < framePeriod){
+            if (!late){
+                late = true;
+                al_start_timer(frameTimer);
+            }
+        } else if (draw){
             redraw(display, font, view);
             al_flip_display();
+            lastFrame = al_get_time();
         }
     }
 